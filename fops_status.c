@@ -23,10 +23,43 @@
 
 #include <linux/slab.h>
 #include <linux/kernel.h>
+#include <linux/mempool.h>
 
 #include "ktext_config.h"
+#include "ktext_ioctl.h"
 #include "fops_status.h"
 
+/* reserves of fops_status_t objects and text buffers, if any */
+static mempool_t *fops_status_pool;
+static mempool_t *fops_text_pool;
+
+int __must_check
+fops_status_pools_init(unsigned int reserve)
+{
+	if (!reserve)
+		return 0;
+
+	fops_status_pool = mempool_create_kmalloc_pool(reserve,
+			sizeof(fops_status_t));
+	fops_text_pool = mempool_create_kmalloc_pool(reserve, KTEXT_READ_SIZE);
+	if (fops_status_pool == NULL || fops_text_pool == NULL) {
+		fops_status_pools_destroy();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void
+fops_status_pools_destroy(void)
+{
+	if (fops_status_pool)
+		mempool_destroy(fops_status_pool);
+	if (fops_text_pool)
+		mempool_destroy(fops_text_pool);
+	fops_status_pool = NULL;
+	fops_text_pool = NULL;
+}
+
 /**
  * fops_status_init() - initialize a fops_status_t object.
  *
@@ -53,7 +86,12 @@ fops_status_init(fops_status_t **fs, bool allocate_text)
 		BUG();
 	}
 
-	*fs = kmalloc(sizeof(fops_status_t), GFP_KERNEL);
+	/* from the reserve, if any: no direct reclaim as long
+	 * as it is not exhausted */
+	if (fops_status_pool)
+		*fs = mempool_alloc(fops_status_pool, GFP_KERNEL);
+	else
+		*fs = kmalloc(sizeof(fops_status_t), GFP_KERNEL);
 	if (*fs == NULL) {
 		printk(KERN_NOTICE "ktext, fops_status_init: unable to allocate fops_status_t!\n");
 		status = -ENOMEM;
@@ -65,7 +103,12 @@ fops_status_init(fops_status_t **fs, bool allocate_text)
 #endif
 
 	if (allocate_text) {
-		(*fs)->text = (char *) kzalloc(sizeof(char) * KTEXT_SIZE, GFP_KERNEL);
+		/* binary safe, lengths are tracked, no need to zero it */
+		if (fops_text_pool)
+			(*fs)->text = mempool_alloc(fops_text_pool, GFP_KERNEL);
+		else
+			(*fs)->text = (char *) kmalloc(sizeof(char) * KTEXT_READ_SIZE,
+					GFP_KERNEL);
 		if ((*fs)->text == NULL) {
 			printk(KERN_NOTICE "ktext, fops_status_init: unable to allocate text!\n");
 			status = -ENOMEM;
@@ -77,7 +120,15 @@ fops_status_init(fops_status_t **fs, bool allocate_text)
 	(*fs)->count = 0;
 
 	(*fs)->total = KTEXT_SIZE;
-	(*fs)->read_text_strlen = 0;
+	(*fs)->read_text_len = 0;
+	(*fs)->prio = KTEXT_PRIO_DEFAULT;
+	(*fs)->ttl = 0;
+	(*fs)->framing = KTEXT_FRAMING_NONE;
+	(*fs)->lease = 0;
+	(*fs)->popped = false;
+	(*fs)->reserved = false;
+	(*fs)->quota = NULL;
+	(*fs)->throttled = false;
 
 #ifdef KTEXT_DEBUG
 	printk(KERN_NOTICE "fops_status_init: all done.\n");
@@ -86,7 +137,10 @@ fops_status_init(fops_status_t **fs, bool allocate_text)
 	goto fops_status_init_quit;
 
 fops_status_init_dealloc_fs:
-	kfree(*fs);
+	if (fops_status_pool)
+		mempool_free(*fs, fops_status_pool);
+	else
+		kfree(*fs);
 
 fops_status_init_quit:
 	return status;
@@ -108,9 +162,15 @@ fops_status_destroy(fops_status_t *fs)
 		BUG();
 
 	if (fs->text) {
-		kfree(fs->text);
+		if (fops_text_pool)
+			mempool_free(fs->text, fops_text_pool);
+		else
+			kfree(fs->text);
 		fs->text = NULL;
 	}
-	kfree(fs);
+	if (fops_status_pool)
+		mempool_free(fs, fops_status_pool);
+	else
+		kfree(fs);
 	fs = NULL;
 }
@@ -24,15 +24,32 @@
 #ifndef FOPS_STATUS_H_
 #define FOPS_STATUS_H_
 
+#include "ktext_quota.h"
+
 /**
  * struct fops_status - 	object used for tracking a request status
  * 				from ktext_open() through ktext_read() or
  * 				ktext_write() to ktext_release()
  *
- * @text:			the actual text string being processed
+ * @text:			the actual text being processed, may contain
+ * 				NUL bytes
  * @count:			the offset in @text
- * @read_text_strlen:		strlen(@text), used by readers
- * @total:			size of @text buffer
+ * @read_text_len:		length of @text, used by readers
+ * @total:			maximum length of @text, used by writers,
+ * 				the buffer is KTEXT_READ_SIZE bytes
+ * @prio:			priority level of @text, used by writers
+ * @ttl:			time-to-live of @text in ms, used by writers
+ * @framing:			KTEXT_FRAMING_* mode, used by readers and
+ * 				(KTEXT_FRAMING_LENGTH only) writers
+ * @lease:			lease duration in ms, 0 if not leasing,
+ * 				used by readers
+ * @popped:			@text has been popped, used by readers
+ * @reserved:			a FIFO slot has been reserved for @text
+ * 				by ktext_reserve(), used by writers
+ * @quota:			the quota of the writer process, NULL if
+ * 				quotas are off, used by writers
+ * @throttled:			over quota, @text shall be dropped, used
+ * 				by writers
  *
  * This object is private to a single request. Given this
  * scope, it doesn't require any protection.
@@ -40,11 +57,39 @@
 typedef struct fops_status {
 	char *text;
 	loff_t count;
-	loff_t read_text_strlen; /* only used by readers */
+	loff_t read_text_len; /* only used by readers */
 	size_t total;
+	unsigned int prio; /* only used by writers */
+	unsigned int ttl; /* only used by writers */
+	unsigned int framing;
+	unsigned int lease; /* only used by readers */
+	bool popped; /* only used by readers */
+	bool reserved; /* only used by writers */
+	ktext_quota_t *quota; /* only used by writers */
+	bool throttled; /* only used by writers */
 } fops_status_t;
 
 
+/**
+ * fops_status_pools_init() - create the fops_status_t reserves
+ *
+ * @reserve:	number of fops_status_t objects, with their text
+ * 		buffer, to be preallocated, 0 for none
+ *
+ * With a reserve, fops_status_init() never enters direct reclaim
+ * as long as less than @reserve objects are in use, and waits for
+ * one to be released instead of failing.
+ */
+int __must_check
+fops_status_pools_init(unsigned int reserve);
+
+/**
+ * fops_status_pools_destroy() - free the fops_status_t reserves
+ *
+ */
+void
+fops_status_pools_destroy(void);
+
 /**
  * fops_status_init() - initialize a fops_status_t object.
  *
@@ -0,0 +1,118 @@
+/*
+ * ktext_api.c
+ *
+ * In-kernel producer/consumer API exported to other modules.
+ *
+ * Copyright (C) 2011 Fabio Erculiani
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ * NON INFRINGEMENT.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+
+#include "ktext_config.h"
+#include "ktext_object.h"
+#include "ktext_api.h"
+
+int __must_check
+ktext_kernel_push(ktext_object_t *k, const void *data, size_t len,
+		unsigned int prio, unsigned int ttl_ms)
+{
+	might_sleep();
+
+	if (len > KTEXT_SIZE)
+		return -EMSGSIZE;
+	if (prio >= KTEXT_PRIO_LEVELS)
+		return -EINVAL;
+	if (!ktext_reserve(k))
+		return -ENOSPC;
+
+	return ktext_push(k, data, len, prio, msecs_to_jiffies(ttl_ms), true,
+			NULL);
+}
+EXPORT_SYMBOL_GPL(ktext_kernel_push);
+
+int __must_check
+ktext_kernel_push_atomic(ktext_object_t *k, const void *data, size_t len,
+		unsigned int prio)
+{
+	if (prio >= KTEXT_PRIO_LEVELS)
+		return -EINVAL;
+
+	return ktext_push_atomic(k, data, len, prio);
+}
+EXPORT_SYMBOL_GPL(ktext_kernel_push_atomic);
+
+int __must_check
+ktext_kernel_pop(ktext_object_t *k, struct ktext_record *recs,
+		unsigned int nr)
+{
+	unsigned int i;
+
+	might_sleep();
+
+	for (i = 0; i < nr; i++) {
+		recs[i].text = NULL;
+		recs[i].len = (size_t) -1;
+	}
+	return ktext_pop_batch(k, recs, nr, 0);
+}
+EXPORT_SYMBOL_GPL(ktext_kernel_pop);
+
+int __must_check
+ktext_kernel_pop_into(ktext_object_t *k, struct ktext_record *recs,
+		unsigned int nr, char *buf, size_t size)
+{
+	unsigned int i;
+
+	might_sleep();
+
+	for (i = 0; i < nr; i++) {
+		recs[i].text = NULL;
+		recs[i].len = (size_t) -1;
+	}
+	return ktext_pop_batch_into(k, recs, nr, buf, size, 0);
+}
+EXPORT_SYMBOL_GPL(ktext_kernel_pop_into);
+
+void
+ktext_kernel_release(struct ktext_record *recs, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		kfree(recs[i].text);
+		recs[i].text = NULL;
+	}
+}
+EXPORT_SYMBOL_GPL(ktext_kernel_release);
+
+int
+ktext_kernel_register_notifier(ktext_object_t *k, struct notifier_block *nb)
+{
+	return ktext_register_notifier(k, nb);
+}
+EXPORT_SYMBOL_GPL(ktext_kernel_register_notifier);
+
+int
+ktext_kernel_unregister_notifier(ktext_object_t *k, struct notifier_block *nb)
+{
+	return ktext_unregister_notifier(k, nb);
+}
+EXPORT_SYMBOL_GPL(ktext_kernel_unregister_notifier);
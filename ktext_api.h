@@ -0,0 +1,154 @@
+/*
+ * ktext_api.h
+ *
+ * In-kernel producer/consumer API, for other modules willing to
+ * feed (or drain) the ktext FIFO without going through /dev/ktext.
+ *
+ * Copyright (C) 2011 Fabio Erculiani
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ * NON INFRINGEMENT.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef KTEXT_API_H_
+#define KTEXT_API_H_
+
+#include <linux/notifier.h>
+
+#include "ktext_object.h"
+
+/*
+ * These functions skip the /dev/ktext file path entirely: no
+ * fops_status_t, no readers/writers lock, just the FIFO lock.
+ * They can run concurrently with /dev/ktext readers and writers.
+ * All of them but the notifier callbacks may sleep.
+ */
+
+/**
+ * ktext_queue_get() - look up a FIFO by name
+ *
+ * @name:	the FIFO name, "ktext" (the device name) is the only one
+ *
+ * The FIFO lives as long as the ktext module does, and using
+ * this API makes your module depend on it.
+ * Returns NULL if there is no such FIFO.
+ */
+ktext_object_t *
+ktext_queue_get(const char *name);
+
+/**
+ * ktext_kernel_push() - push a text to the FIFO
+ *
+ * @k:		the FIFO, see ktext_queue_get()
+ * @data:	the text, binary safe, copied
+ * @len:	the length of @data, at most KTEXT_SIZE
+ * @prio:	priority level, 0 (most urgent) to KTEXT_PRIO_LEVELS - 1
+ * @ttl_ms:	time-to-live in milliseconds, 0 for none
+ *
+ * The max_elements limit and the full policy apply as for
+ * /dev/ktext writers.
+ * Returns 0 on success, -ENOSPC if full, -EMSGSIZE if @len is
+ * too big, -EINVAL if @prio is out of range, -ENOMEM, -EINTR.
+ */
+int __must_check
+ktext_kernel_push(ktext_object_t *k, const void *data, size_t len,
+		unsigned int prio, unsigned int ttl_ms);
+
+/**
+ * ktext_kernel_push_atomic() - push a text to the FIFO, from any context
+ *
+ * @k:		the FIFO, see ktext_queue_get()
+ * @data:	the text, binary safe, copied
+ * @len:	the length of @data, at most KTEXT_ATOMIC_SIZE
+ * @prio:	priority level, 0 (most urgent) to KTEXT_PRIO_LEVELS - 1
+ *
+ * Never sleeps, usable from interrupt handlers and with spinlocks
+ * held. No time-to-live. See ktext_push_atomic().
+ * Returns 0 on success, -ENOSPC if full, -ENOBUFS if the node pool
+ * of the local CPU is exhausted (or if the module was loaded without
+ * atomic_pool=), -EMSGSIZE, -EINVAL.
+ */
+int __must_check
+ktext_kernel_push_atomic(ktext_object_t *k, const void *data, size_t len,
+		unsigned int prio);
+
+/**
+ * ktext_kernel_pop() - pop up to @nr texts from the FIFO
+ *
+ * @k:		the FIFO, see ktext_queue_get()
+ * @recs:	the records to fill
+ * @nr:		the number of records at @recs
+ *
+ * The FIFO lock is taken only once for the whole batch.
+ * Returns the number of records filled (0 if the FIFO is empty),
+ * <0 if interrupted. Release them with ktext_kernel_release().
+ */
+int __must_check
+ktext_kernel_pop(ktext_object_t *k, struct ktext_record *recs,
+		unsigned int nr);
+
+/**
+ * ktext_kernel_pop_into() - pop up to @nr texts from the FIFO, into
+ * 			     a buffer
+ *
+ * @k:		the FIFO, see ktext_queue_get()
+ * @recs:	the records to fill
+ * @nr:		the number of records at @recs
+ * @buf:	where to copy the texts, back to back
+ * @size:	the size of @buf
+ *
+ * Same as ktext_kernel_pop(), without allocating: recs[i].text
+ * points into @buf, nothing to release. Stops at the first text
+ * not fitting what is left of @buf, -EMSGSIZE if that's the first.
+ */
+int __must_check
+ktext_kernel_pop_into(ktext_object_t *k, struct ktext_record *recs,
+		unsigned int nr, char *buf, size_t size);
+
+/**
+ * ktext_kernel_release() - free the texts returned by ktext_kernel_pop()
+ *
+ * @recs:	the records
+ * @nr:		the number of records filled by ktext_kernel_pop()
+ *
+ */
+void
+ktext_kernel_release(struct ktext_record *recs, unsigned int nr);
+
+/**
+ * ktext_kernel_register_notifier() - get called back on enqueue
+ *
+ * @k:		the FIFO, see ktext_queue_get()
+ * @nb:		the notifier_block object
+ *
+ * @nb->notifier_call() is called after every successful push,
+ * from any producer, with the priority level of the new text as
+ * action and @k as data. It runs in atomic context and shall not
+ * sleep: schedule some work to do the actual ktext_kernel_pop().
+ */
+int
+ktext_kernel_register_notifier(ktext_object_t *k, struct notifier_block *nb);
+
+/**
+ * ktext_kernel_unregister_notifier() - undo ktext_kernel_register_notifier()
+ *
+ * @k:		the FIFO, see ktext_queue_get()
+ * @nb:		the notifier_block object
+ *
+ */
+int
+ktext_kernel_unregister_notifier(ktext_object_t *k, struct notifier_block *nb);
+
+#endif
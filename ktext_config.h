@@ -44,6 +44,102 @@
  */
 #define KTEXT_ALT_RW_STARV_PROT
 
+/**
+ * Number of trylock attempts done by ktext_reader_lock() and
+ * ktext_writer_lock() before going to sleep. Critical sections
+ * are short, spinning a bit saves a sleep/wakeup cycle.
+ * Set to 0 to disable spinning.
+ */
+#define KTEXT_LOCK_SPIN 100
+
+/**
+ * When a lock acquisition deadline is set, sleeping is done
+ * in slices of this many jiffies, checking for fatal signals
+ * in between (there is no killable down_timeout()).
+ */
+#define KTEXT_LOCK_SLICE (HZ / 10)
+
+/**
+ * Number of priority levels of the FIFO (1 to 64). Each level
+ * is a FIFO on its own, ktext_pop() always serves the most
+ * urgent (lowest numbered) non-empty level first.
+ */
+#define KTEXT_PRIO_LEVELS 8
+
+/**
+ * Priority level given to texts whose writer didn't ask for
+ * one through KTEXT_IOC_SET_PRIO.
+ */
+#define KTEXT_PRIO_DEFAULT (KTEXT_PRIO_LEVELS / 2)
+
+/**
+ * Texts with a time-to-live are hashed on a timer wheel of
+ * KTEXT_TTL_BUCKETS lists (a power of two), each one covering
+ * 2^KTEXT_TTL_BUCKET_SHIFT jiffies. A periodic sweep reclaims the
+ * expired texts one bucket at a time, ktext_pop() skips them.
+ */
+#define KTEXT_TTL_BUCKETS 256
+#define KTEXT_TTL_BUCKET_SHIFT 5
+
+/**
+ * ktext_push_atomic() takes its nodes from per-CPU pools of
+ * preallocated nodes (see atomic_pool=), each one holding texts
+ * up to KTEXT_ATOMIC_SIZE bytes inline.
+ */
+#define KTEXT_ATOMIC_SIZE 256
+
+/**
+ * With spill_threshold= set, the spill file is read back in
+ * chunks of this many bytes (more than KTEXT_SIZE).
+ */
+#define KTEXT_SPILL_CHUNK (64 * 1024)
+
+/**
+ * KTEXT_IOC_EXPORT and KTEXT_IOC_IMPORT copy the dumps from and to
+ * userspace in chunks of this many bytes (more than
+ * KTEXT_RECORD_SIZE plus a struct ktext_dump_record), the most
+ * KTEXT_IOC_PEEK_RANGE fills per call.
+ */
+#define KTEXT_DUMP_CHUNK (64 * 1024)
+
+/**
+ * Writers quotas are hashed by tgid on 2^KTEXT_QUOTA_HASH_BITS
+ * buckets.
+ */
+#define KTEXT_QUOTA_HASH_BITS 6
+
+/**
+ * If defined, texts and their nodes are bump-allocated contiguously
+ * in chunks of 2^KTEXT_ARENA_ORDER pages, instead of two kmalloc()s
+ * per text. A chunk is freed as a whole once all its texts are gone.
+ * A chunk must fit a KTEXT_RECORD_SIZE record.
+ * Off by default: pops have to copy arena texts out, and one long
+ * lived text pins its whole chunk.
+ */
+/* #define KTEXT_ARENA */
+#define KTEXT_ARENA_ORDER 2
+
+/**
+ * Without KTEXT_ARENA, the reserve= texts come in
+ * KTEXT_RESERVE_CLASSES size classes: 128 bytes, 1KiB and a whole
+ * KTEXT_RECORD_SIZE record, each text taking the smallest fitting.
+ */
+#define KTEXT_RESERVE_CLASSES 3
+
+/**
+ * Maximum number of texts popped by a single readv(), one per
+ * iovec, under a single FIFO lock acquisition.
+ */
+#define KTEXT_READV_BATCH 64
+
+/**
+ * Texts popped to be copied out to userspace (readv() batches,
+ * KTEXT_IOC_EXPORT chunks, io_uring pops) are leased for this many ms, for readers
+ * without a lease too, the lease being ended once the copy is done:
+ * texts that could not be copied are put back at the head.
+ */
+#define KTEXT_COPY_LEASE 60000
+
 /**
  * kmalloc doesn't work with large requests.
  * Since this is a very simple module, we just limit
@@ -51,4 +147,36 @@
  */
 #define KTEXT_SIZE (size_t)(PAGE_SIZE - 1 - 100)
 
+/**
+ * The largest FIFO record: a KTEXT_SIZE text preceded by its
+ * length, as stored when coalescing (see coalesce_size=).
+ */
+#define KTEXT_RECORD_SIZE (KTEXT_SIZE + sizeof(__u32))
+
+/**
+ * Size of the reader buffers: a record, preceded by its sequence
+ * number when leased (see KTEXT_IOC_SET_LEASE).
+ */
+#define KTEXT_READ_SIZE (KTEXT_RECORD_SIZE + sizeof(__u64))
+
+/**
+ * With intern_max= set, the shared texts are hashed on
+ * 2^KTEXT_INTERN_HASH_BITS buckets, with a random seed. A text
+ * whose bucket holds KTEXT_INTERN_CHAIN_MAX others already is
+ * pushed on its own, not interned.
+ */
+#define KTEXT_INTERN_HASH_BITS 10
+#define KTEXT_INTERN_CHAIN_MAX 8
+
+/**
+ * Kernel crypto compression algorithm used with compress_threshold=.
+ */
+#define KTEXT_COMPRESS_ALG "lz4"
+
+/**
+ * Expired leases are requeued by a sweep running every
+ * KTEXT_LEASE_SWEEP jiffies, while records are in flight.
+ */
+#define KTEXT_LEASE_SWEEP (HZ / 10)
+
 #endif
@@ -0,0 +1,404 @@
+/*
+ * ktext_ioctl.h
+ *
+ * ioctl() commands understood by /dev/ktext, shared with userspace.
+ *
+ * Copyright (C) 2011 Fabio Erculiani
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ * NON INFRINGEMENT.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef KTEXT_IOCTL_H_
+#define KTEXT_IOCTL_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define KTEXT_IOC_MAGIC 'k'
+
+/**
+ * KTEXT_IOC_SET_PRIO - set the priority level of the text being written.
+ *
+ * Writers only. Takes a pointer to a __u32 between 0 (most urgent)
+ * and KTEXT_PRIO_LEVELS - 1. Can be issued anytime before close().
+ */
+#define KTEXT_IOC_SET_PRIO _IOW(KTEXT_IOC_MAGIC, 1, __u32)
+
+/**
+ * KTEXT_IOC_SET_TTL - set the time-to-live of the text being written.
+ *
+ * Writers only. Takes a pointer to a __u32 holding the time-to-live
+ * in milliseconds, 0 meaning the default_ttl module parameter.
+ * Expired texts are discarded instead of being handed to readers.
+ */
+#define KTEXT_IOC_SET_TTL _IOW(KTEXT_IOC_MAGIC, 2, __u32)
+
+/**
+ * KTEXT_IOC_SET_FRAMING - switch a reader to streaming mode.
+ *
+ * Readers: before the first read(). Takes a pointer to a __u32,
+ * one of the KTEXT_FRAMING_* values below. In streaming mode, each
+ * read() pops as many texts as they fit in the buffer, instead of
+ * returning a single text per open(). Only whole texts are returned,
+ * one not fitting is left at the head of the FIFO, if not even the
+ * first one fits read() fails with -EMSGSIZE. read() returns 0 once
+ * the FIFO is drained.
+ *
+ * Writers: before the first write(), KTEXT_FRAMING_LENGTH only. What
+ * is written, at most KTEXT_SIZE bytes, is a sequence of texts each
+ * one preceded by its length, pushed one by one on close().
+ */
+#define KTEXT_IOC_SET_FRAMING _IOW(KTEXT_IOC_MAGIC, 4, __u32)
+
+/* one text per open(), the default */
+#define KTEXT_FRAMING_NONE 0
+/* each text is followed by a NUL byte */
+#define KTEXT_FRAMING_NUL 1
+/* each text is followed by a newline */
+#define KTEXT_FRAMING_NEWLINE 2
+/* each text is preceded by its length, as a host endian __u32 */
+#define KTEXT_FRAMING_LENGTH 3
+
+/**
+ * struct ktext_stats - FIFO counters, see KTEXT_IOC_GET_STATS
+ *
+ * @n_elem:	number of texts in the FIFO
+ * @n_expired:	number of texts discarded because their time-to-live expired
+ * @n_dropped:	number of texts discarded because the FIFO was full
+ */
+struct ktext_stats {
+	__u64 n_elem;
+	__u64 n_expired;
+	__u64 n_dropped;
+};
+
+/**
+ * KTEXT_IOC_GET_STATS - read the FIFO counters.
+ *
+ * Readers and writers. Takes a pointer to a struct ktext_stats.
+ */
+#define KTEXT_IOC_GET_STATS _IOR(KTEXT_IOC_MAGIC, 3, struct ktext_stats)
+
+/*
+ * The following commands are issued on /dev/ktext_ctl, which takes
+ * no readers/writers lock: they never wait for, nor delay, readers
+ * and writers sessions.
+ */
+
+/**
+ * struct ktext_query - FIFO occupancy, see KTEXT_IOC_QUERY
+ *
+ * @n_elem:		number of texts in the FIFO
+ * @n_bytes:		total length of the texts in the FIFO
+ * @head_age_ms:	time spent in the FIFO by the next text to be
+ * 			read, in milliseconds, 0 if empty
+ */
+struct ktext_query {
+	__u64 n_elem;
+	__u64 n_bytes;
+	__u64 head_age_ms;
+};
+
+/**
+ * KTEXT_IOC_QUERY - read the FIFO occupancy in one call.
+ *
+ * /dev/ktext_ctl only. Takes a pointer to a struct ktext_query.
+ */
+#define KTEXT_IOC_QUERY _IOR(KTEXT_IOC_MAGIC, 5, struct ktext_query)
+
+/**
+ * struct ktext_peek - a text looked at in place, see KTEXT_IOC_PEEK
+ *
+ * @index:	in: position of the text, 0 being the next one to be read
+ * @prio:	out: priority level of the text
+ * @len:	in: size of @buf, out: length of the text (the copy is
+ * 		truncated to the size of @buf)
+ * @age_ms:	out: time spent in the FIFO by the text, in milliseconds
+ * @buf:	in: userspace buffer, cast to __u64
+ */
+struct ktext_peek {
+	__u32 index;
+	__u32 prio;
+	__u64 len;
+	__u64 age_ms;
+	__u64 buf;
+};
+
+/*
+ * Peeking walks the FIFO under its lock: only the first
+ * KTEXT_PEEK_WINDOW queued texts are reachable, so that pushes and
+ * pops are never held for longer than that walk.
+ */
+#define KTEXT_PEEK_WINDOW 256
+
+/**
+ * KTEXT_IOC_PEEK - copy a text out of the FIFO, without dequeuing it.
+ *
+ * /dev/ktext_ctl only. Takes a pointer to a struct ktext_peek.
+ * Texts are indexed in reading order. Fails with -ENOENT past the
+ * last text (texts spilled to shmem are not reachable until read
+ * back), -ERANGE past KTEXT_PEEK_WINDOW.
+ */
+#define KTEXT_IOC_PEEK _IOWR(KTEXT_IOC_MAGIC, 6, struct ktext_peek)
+
+/**
+ * struct ktext_peek_range - texts looked at in place, see
+ * 			     KTEXT_IOC_PEEK_RANGE
+ *
+ * @first:	in: position of the first text, 0 being the next one
+ * 		to be read
+ * @count:	in: maximum number of texts, out: number of texts copied
+ * @len:	in: size of @buf, out: number of bytes filled
+ * @buf:	in: userspace buffer, cast to __u64
+ */
+struct ktext_peek_range {
+	__u32 first;
+	__u32 count;
+	__u64 len;
+	__u64 buf;
+};
+
+/**
+ * struct ktext_peek_record - a text in a KTEXT_IOC_PEEK_RANGE buffer,
+ * 			      followed by its @len bytes
+ *
+ * @len:	the length of the text
+ * @prio:	the priority level of the text
+ * @age_ms:	time spent in the FIFO by the text, in milliseconds
+ */
+struct ktext_peek_record {
+	__u32 len;
+	__u32 prio;
+	__u64 age_ms;
+};
+
+/**
+ * KTEXT_IOC_PEEK_RANGE - copy texts first to first + count - 1 out of
+ * the FIFO, without dequeuing them.
+ *
+ * /dev/ktext_ctl only. Takes a pointer to a struct ktext_peek_range.
+ * Each text is copied whole, as a struct ktext_peek_record followed by
+ * the text, the range ending early at the first one not fitting (at
+ * most KTEXT_DUMP_CHUNK, 64KiB, are filled per call) or at the end of
+ * the FIFO. The range is clamped to KTEXT_PEEK_WINDOW, fails with
+ * -ERANGE if @first is past it, -EMSGSIZE if not even the first text
+ * fits. One FIFO lock acquisition per call.
+ */
+#define KTEXT_IOC_PEEK_RANGE _IOWR(KTEXT_IOC_MAGIC, 13, struct ktext_peek_range)
+
+/**
+ * struct ktext_watermarks - see KTEXT_IOC_SET_WATERMARKS
+ *
+ * @high_fd:	eventfd signaled when the FIFO level reaches @high,
+ * 		-1 for none
+ * @low_fd:	eventfd signaled when the FIFO level, after having
+ * 		reached @high, goes back to @low, -1 for none
+ * @high:	the high watermark, more than @low
+ * @low:	the low watermark
+ * @flags:	KTEXT_WM_* flags
+ * @pad:	must be zero
+ */
+struct ktext_watermarks {
+	__s32 high_fd;
+	__s32 low_fd;
+	__u64 high;
+	__u64 low;
+	__u32 flags;
+	__u32 pad;
+};
+
+/* watermarks are in bytes, instead of texts */
+#define KTEXT_WM_BYTES 0x1
+
+/**
+ * KTEXT_IOC_SET_WATERMARKS - get notified of the FIFO level through eventfds.
+ *
+ * /dev/ktext_ctl only. Takes a pointer to a struct ktext_watermarks,
+ * replacing the previous one, both fds set to -1 disable the
+ * notifications. Edge triggered, with hysteresis: @high_fd is signaled
+ * once when the level reaches @high (right away if it is already
+ * there), then @low_fd once when it drops to @low, and so on.
+ */
+#define KTEXT_IOC_SET_WATERMARKS _IOW(KTEXT_IOC_MAGIC, 7, struct ktext_watermarks)
+
+/**
+ * KTEXT_IOC_SET_LEASE - switch a reader to at-least-once delivery.
+ *
+ * Readers only, before the first read(). Takes a pointer to a __u32
+ * holding the lease duration in milliseconds, 0 turning leases off.
+ * Popped texts are then kept in flight, each one delivered preceded
+ * by its sequence number as a host endian __u64, and put back at the
+ * head of the FIFO if not acked within the lease, see KTEXT_IOC_ACK.
+ */
+#define KTEXT_IOC_SET_LEASE _IOW(KTEXT_IOC_MAGIC, 8, __u32)
+
+/**
+ * struct ktext_ack - see KTEXT_IOC_ACK
+ *
+ * @first:	the first sequence number to acknowledge, 0 to
+ * 		acknowledge everything up to @last
+ * @last:	the last sequence number to acknowledge
+ */
+struct ktext_ack {
+	__u64 first;
+	__u64 last;
+};
+
+/**
+ * KTEXT_IOC_ACK - acknowledge leased texts, freeing them for good.
+ *
+ * /dev/ktext_ctl only. Takes a pointer to a struct ktext_ack, returns
+ * the number of texts in flight acknowledged.
+ */
+#define KTEXT_IOC_ACK _IOW(KTEXT_IOC_MAGIC, 9, struct ktext_ack)
+
+/**
+ * struct ktext_comp_stats - see KTEXT_IOC_GET_COMP_STATS
+ *
+ * @n_compressed:	number of texts stored compressed
+ * @bytes_in:		their total length
+ * @bytes_out:		their total length once compressed
+ * @compress_ns:	time spent compressing, in ns
+ * @decompress_ns:	time spent decompressing, in ns
+ */
+struct ktext_comp_stats {
+	__u64 n_compressed;
+	__u64 bytes_in;
+	__u64 bytes_out;
+	__u64 compress_ns;
+	__u64 decompress_ns;
+};
+
+/**
+ * KTEXT_IOC_GET_COMP_STATS - read the compression counters.
+ *
+ * /dev/ktext_ctl only. Takes a pointer to a struct ktext_comp_stats.
+ * The counters are cumulative, since the module was loaded.
+ */
+#define KTEXT_IOC_GET_COMP_STATS _IOR(KTEXT_IOC_MAGIC, 10, struct ktext_comp_stats)
+
+/**
+ * struct ktext_dump - a dump buffer, see KTEXT_IOC_EXPORT
+ *
+ * @addr:	the userspace buffer
+ * @len:	its size; on return, the number of bytes filled
+ * 		(KTEXT_IOC_EXPORT) or consumed (KTEXT_IOC_IMPORT)
+ * @n_texts:	on return, the number of texts exported or imported
+ * @skip:	KTEXT_IOC_IMPORT only: texts of the first record imported
+ * 		already, 0 to start; on return, those of the first record
+ * 		not consumed, to be passed back as they are
+ * @pad:	0
+ */
+struct ktext_dump {
+	__u64 addr;
+	__u64 len;
+	__u64 n_texts;
+	__u32 skip;
+	__u32 pad;
+};
+
+/**
+ * struct ktext_dump_record - a text in a dump, followed by its @len
+ * 			      bytes
+ *
+ * @len:	the length of the text
+ * @ttl_ms:	the time-to-live left, in ms, 0 for none
+ * @prio:	the priority level
+ * @flags:	KTEXT_DUMP_PACKED if the text is a coalesced record,
+ * 		a sequence of texts each one preceded by its length
+ * 		as a host endian __u32
+ * @pad:	0
+ */
+struct ktext_dump_record {
+	__u32 len;
+	__u32 ttl_ms;
+	__u8 prio;
+	__u8 flags;
+	__u16 pad;
+};
+
+#define KTEXT_DUMP_PACKED 0x1
+
+/*
+ * A dump file, as written by libktext, is made of a struct
+ * ktext_dump_header followed by the records, back to back.
+ */
+#define KTEXT_DUMP_MAGIC 0x6b747874 /* "ktxt" */
+#define KTEXT_DUMP_VERSION 1
+
+struct ktext_dump_header {
+	__u32 magic;
+	__u32 version;
+};
+
+/**
+ * KTEXT_IOC_EXPORT - move the FIFO content to a userspace buffer.
+ *
+ * /dev/ktext_ctl only. Takes a pointer to a struct ktext_dump. Pops
+ * as many texts as they fit in the buffer, in the order readers would
+ * get them, each one as a struct ktext_dump_record followed by the
+ * text. Records being filled (coalesce_size=) are queued first, texts
+ * leased and not acked are requeued first. Returns -EMSGSIZE if not
+ * even the first text fits, -EFAULT if the buffer can't be written,
+ * the texts staying in the FIFO. Call it until it exports nothing.
+ */
+#define KTEXT_IOC_EXPORT _IOWR(KTEXT_IOC_MAGIC, 11, struct ktext_dump)
+
+/**
+ * KTEXT_IOC_IMPORT - push the texts of a dump.
+ *
+ * /dev/ktext_ctl only. Takes a pointer to a struct ktext_dump, holding
+ * records as produced by KTEXT_IOC_EXPORT. Only whole records are
+ * consumed: a truncated one at the end is left for the next call.
+ * Coalesced records are unpacked. max_elements= and full_policy=
+ * apply, writer quotas don't. Returns -EINVAL on a malformed record,
+ * -ENOSPC once max_elements is reached with full_policy=0.
+ * On errors too, @len, @n_texts and @skip are updated: call it again
+ * from @addr + @len with the returned @skip, no text is pushed twice.
+ */
+#define KTEXT_IOC_IMPORT _IOWR(KTEXT_IOC_MAGIC, 12, struct ktext_dump)
+
+/*
+ * io_uring commands (sqe->cmd_op of IORING_OP_URING_CMD), on
+ * /dev/ktext_ctl, Linux 6.7 and later. The sqe->cmd payload is a
+ * struct ktext_uring_cmd.
+ *
+ * KTEXT_URING_PUSH: push the @len bytes at @addr with priority @prio,
+ * completes with 0 or an error. Limits and quotas apply as to writers.
+ * KTEXT_URING_POP: pop one text into the @len bytes buffer at @addr,
+ * completes with its length once there is one.
+ * KTEXT_URING_POP_BATCH: same, popping as many texts as they fit, each
+ * preceded by its length as a host endian __u32, completes with the
+ * total length.
+ */
+#define KTEXT_URING_PUSH 1
+#define KTEXT_URING_POP 2
+#define KTEXT_URING_POP_BATCH 3
+
+/**
+ * struct ktext_uring_cmd - payload of the KTEXT_URING_* commands
+ *
+ * @addr:	the userspace buffer
+ * @len:	the length of the text, or the size of @addr
+ * @prio:	the priority level of the text, KTEXT_URING_PUSH only
+ */
+struct ktext_uring_cmd {
+	__u64 addr;
+	__u32 len;
+	__u32 prio;
+};
+
+#endif
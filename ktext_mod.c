@@ -54,17 +54,269 @@
 #include <linux/miscdevice.h>
 #include <linux/list.h>
 #include <linux/init.h>
+#include <linux/jiffies.h>
+#include <linux/nodemask.h>
+#include <linux/uio.h>
+#include <linux/sched.h>
+#include <linux/eventfd.h>
+#include <linux/err.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,10,0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+#include <linux/io_uring.h>
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18)
+#include <asm/uaccess.h>
+#else
+#include <linux/uaccess.h>
+#endif
 
 #include "ktext_config.h"
+#include "ktext_ioctl.h"
 #include "ktext_object.h"
+#include "ktext_api.h"
+#include "ktext_quota.h"
 #include "fops_status.h"
 
+/* global k_text object */
+static ktext_object_t *ktext;
+static ktext_quota_table_t *ktext_quotas;
+
 int max_elements = 0;
+int full_policy = KTEXT_FULL_REJECT;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+
+/**
+ * ktext_max_elements_set() - max_elements parameter setter.
+ *
+ * @val:	the new value, as a string
+ * @kp:		the kernel_param object
+ *
+ * Validate the new value, and apply it right away if the
+ * FIFO is already there (runtime change through sysfs).
+ *
+ */
+static int
+ktext_max_elements_set(const char *val, const struct kernel_param *kp)
+{
+	int n;
+	int status;
+
+	status = kstrtoint(val, 0, &n);
+	if (status != 0)
+		return status;
+	if ((n < 0) || (n > 10000))
+		return -EINVAL;
+
+	max_elements = n;
+	if (ktext)
+		ktext_set_limit(ktext, max_elements, full_policy);
+	return 0;
+}
+
+static const struct kernel_param_ops ktext_max_elements_ops = {
+	.set = ktext_max_elements_set,
+	.get = param_get_int,
+};
+
+module_param_cb(max_elements, &ktext_max_elements_ops, &max_elements, 0644);
+#else
 module_param(max_elements, int, 0);
+#endif
 MODULE_PARM_DESC(max_elements, "Maximum amount of FIFO elements");
 
-/* global k_text object */
-static ktext_object_t *ktext;
+module_param(full_policy, int, 0);
+MODULE_PARM_DESC(full_policy, "What to do when max_elements is reached "
+		"(0: reject, 1: drop oldest, 2: drop newest)");
+
+/* not numa_node, which is the kernel per-CPU variable */
+static int fifo_node = NUMA_NO_NODE;
+module_param_named(numa_node, fifo_node, int, 0);
+MODULE_PARM_DESC(numa_node, "NUMA node to allocate the FIFO on, "
+		"ideally the readers one (-1: no preference)");
+
+int spill_threshold = 0;
+module_param(spill_threshold, int, 0);
+MODULE_PARM_DESC(spill_threshold, "Number of texts kept in memory, the following "
+		"ones are spilled to swappable shmem (0: never spill)");
+
+unsigned int coalesce_size = 0;
+module_param(coalesce_size, uint, 0444);
+MODULE_PARM_DESC(coalesce_size, "Size of the records small texts are packed "
+		"in, each one preceded by its length (0: no packing)");
+
+unsigned int coalesce_delay = 10;
+module_param(coalesce_delay, uint, 0);
+MODULE_PARM_DESC(coalesce_delay, "Maximum time in ms a text waits for its "
+		"record to fill up");
+
+static unsigned int atomic_pool = 0;
+module_param(atomic_pool, uint, 0);
+MODULE_PARM_DESC(atomic_pool, "Nodes preallocated per CPU for in-kernel "
+		"atomic pushes (0: none, they fail)");
+
+unsigned int intern_max = 0;
+module_param(intern_max, uint, 0);
+MODULE_PARM_DESC(intern_max, "Texts up to this long are stored once, shared "
+		"by their identical copies (0: never share)");
+
+unsigned int compress_threshold = 0;
+module_param(compress_threshold, uint, 0);
+MODULE_PARM_DESC(compress_threshold, "Texts at least this long are stored "
+		"compressed (0: never compress)");
+
+unsigned int quota_msgs = 0;
+module_param(quota_msgs, uint, 0644);
+MODULE_PARM_DESC(quota_msgs, "Texts per second each process can write (0: unlimited)");
+
+unsigned int quota_bytes = 0;
+module_param(quota_bytes, uint, 0644);
+MODULE_PARM_DESC(quota_bytes, "Bytes per second each process can write (0: unlimited)");
+
+unsigned int quota_share = 0;
+module_param(quota_share, uint, 0644);
+MODULE_PARM_DESC(quota_share, "Percentage of max_elements each process can "
+		"hold in the FIFO (0: unlimited)");
+
+int quota_policy = KTEXT_QUOTA_REJECT;
+module_param(quota_policy, int, 0644);
+MODULE_PARM_DESC(quota_policy, "What to do with writers over quota "
+		"(0: fail open() with -EAGAIN, 1: drop their texts)");
+
+unsigned int reserve = 0;
+module_param(reserve, uint, 0);
+MODULE_PARM_DESC(reserve, "Number of in-flight texts whose memory is "
+		"preallocated at load time (0: none)");
+
+unsigned int lock_timeout = 0;
+module_param(lock_timeout, uint, 0644);
+MODULE_PARM_DESC(lock_timeout, "open() lock acquisition deadline in ms (0: none)");
+
+unsigned int default_ttl = 0;
+module_param(default_ttl, uint, 0644);
+MODULE_PARM_DESC(default_ttl, "Default time-to-live of the texts in ms (0: forever)");
+
+/**
+ * ktext_fops_status() - get the fops_status_t object of filp
+ *
+ * @filp:	the file object
+ * @fs:		where to store the fops_status_t object
+ *
+ * The fops_status_t object is allocated lazily, on the
+ * first read(), write() or ioctl(), along with its text
+ * buffer: the staging buffer of writers, where readers
+ * pop strings to.
+ *
+ */
+static int
+ktext_fops_status(struct file *filp, fops_status_t **fs)
+{
+	int status;
+
+	status = 0;
+	*fs = (fops_status_t *) filp->private_data;
+	if (*fs == NULL) {
+		status = fops_status_init(fs, true);
+		if (status != 0)
+			goto ktext_fops_status_quit;
+		filp->private_data = *fs;
+	}
+
+ktext_fops_status_quit:
+	return status;
+}
+
+/* the quota_share= of max_elements=, in texts, 0 for unlimited */
+static unsigned int
+ktext_max_resident(void)
+{
+	if (!quota_share || !max_elements)
+		return 0;
+	return max_t(unsigned int, 1,
+			(unsigned int) max_elements * quota_share / 100);
+}
+
+/**
+ * ktext_writer_quota() - check the quota of the current process
+ *
+ * @qp:		where to store the quota, with a reference, NULL if
+ * 		quotas are off
+ * @throttled:	set if over quota with quota_policy=1, the text
+ * 		shall be dropped
+ *
+ * Every text written costs a message token, whichever way it
+ * comes in. Returns -EAGAIN if over quota with quota_policy=0,
+ * -ENOMEM.
+ *
+ */
+static int
+ktext_writer_quota(ktext_quota_t **qp, bool *throttled)
+{
+	unsigned int max_resident;
+	ktext_quota_t *q;
+
+	*qp = NULL;
+	*throttled = false;
+
+	max_resident = ktext_max_resident();
+	if (!quota_msgs && !quota_bytes && !max_resident)
+		return 0;
+
+	q = ktext_quota_get(ktext_quotas, task_tgid_nr(current));
+	if (q == NULL)
+		return -ENOMEM;
+	if (!ktext_quota_admit(ktext_quotas, q, quota_msgs, quota_bytes,
+				max_resident)) {
+#ifdef KTEXT_DEBUG
+		printk(KERN_NOTICE "ktext_writer_quota: tgid %d over quota\n",
+				task_tgid_nr(current));
+#endif
+		if (quota_policy == KTEXT_QUOTA_REJECT) {
+			ktext_quota_put(q);
+			return -EAGAIN;
+		}
+		*throttled = true;
+	}
+	*qp = q;
+	return 0;
+}
+
+/**
+ * ktext_open_quota() - check the quota of the writer process
+ *
+ * @filp:	the file object
+ *
+ * The quota is remembered in the fops_status_t object, for
+ * ktext_release() to charge the written bytes and to hand it
+ * to ktext_push(). Over quota writers get -EAGAIN or, with
+ * quota_policy=1, a throttled fops_status_t whose text is
+ * dropped.
+ *
+ */
+static int
+ktext_open_quota(struct file *filp)
+{
+	int status;
+	fops_status_t *fs;
+	ktext_quota_t *q;
+	bool throttled;
+
+	status = ktext_writer_quota(&q, &throttled);
+	if (status != 0 || q == NULL)
+		return status;
+
+	status = ktext_fops_status(filp, &fs);
+	if (status != 0) {
+		ktext_quota_put(q);
+		return status;
+	}
+	fs->throttled = throttled;
+	fs->quota = q;
+	return 0;
+}
 
 /**
  * ktext_open() - the file_operations.open function.
@@ -80,6 +332,8 @@ static ktext_object_t *ktext;
  * in order to avoid possible US process
  * deadlocks, the readers/writers semaphore
  * will be locked using _trylock() functions.
+ * Blocking waits are killable and, if the lock_timeout
+ * parameter is set, fail with -ETIMEDOUT after it.
  *
  */
 static int
@@ -87,7 +341,8 @@ ktext_open(struct inode *inode, struct file *filp)
 {
 	int status;
 	int rwsem_acquired;
-	int push_allowed;
+	unsigned long timeout;
+	fops_status_t *fs;
 	bool non_block;
 	bool write_mode;
 	bool read_mode;
@@ -100,9 +355,7 @@ ktext_open(struct inode *inode, struct file *filp)
 #if KTEXT_NONBLOCK_SUPPORT
 	/* if two writers call open() in the same process,
 	 * in the same thread, it's the end of the world.
-	 * Not even SIGKILL can come to the rescue.
-	 * This is because there is no interruptible
-	 * version of rw_semaphore.
+	 * Only SIGKILL (or lock_timeout) can come to the rescue.
 	 */
 	non_block = filp->f_flags & O_NONBLOCK;
 #else
@@ -130,12 +383,13 @@ ktext_open(struct inode *inode, struct file *filp)
 #endif
 
 	rwsem_acquired = 0;
+	timeout = msecs_to_jiffies(lock_timeout);
 	if (write_mode) {
 		if (non_block)
 			rwsem_acquired = ktext_writer_trylock(ktext);
 		else {
-			/* CANBLOCK but can be INTERRUPTIBLE */
-			status = ktext_writer_lock(ktext);
+			/* CANBLOCK but KILLABLE */
+			status = ktext_writer_lock(ktext, timeout);
 			if (status)
 				/* not acquired */
 				goto ktext_open_quit;
@@ -145,8 +399,8 @@ ktext_open(struct inode *inode, struct file *filp)
 		if (non_block)
 			rwsem_acquired = ktext_reader_trylock(ktext);
 		else {
-			/* CANBLOCK but can be INTERRUPTIBLE */
-			status = ktext_reader_lock(ktext);
+			/* CANBLOCK but KILLABLE */
+			status = ktext_reader_lock(ktext, timeout);
 			if (status)
 				/* not acquired */
 				goto ktext_open_quit;
@@ -163,28 +417,44 @@ ktext_open(struct inode *inode, struct file *filp)
 		goto ktext_open_quit;
 	}
 
+	/* "trust no one", private_data contains the whole text */
+	filp->private_data = NULL;
+
 	if (!append && write_mode) {
 #ifdef KTEXT_DEBUG
 		printk(KERN_NOTICE "ktext_open: inode: %p - file: %p. "
 				"Write mode (append: off)\n",
 				inode, filp);
 #endif
-		push_allowed = ktext_push_allowed(ktext, max_elements);
-		if (unlikely(!push_allowed)) {
+		if (unlikely(!ktext_reserve(ktext))) {
 			printk(KERN_NOTICE
 					"ktext_open: max_elements limit reached (sorry)\n");
 			status = -ENOSPC;
 			goto ktext_open_quit_write_sem_up;
-		} else if (unlikely(push_allowed < 0)) {
-			printk(KERN_NOTICE
-					"ktext_open: push_allowed interrupted!\n");
-			status = push_allowed;
+		}
+		/* remember the reservation, ktext_release() hands it
+		 * over to ktext_push() */
+		status = ktext_fops_status(filp, &fs);
+		if (unlikely(status != 0)) {
+			ktext_unreserve(ktext);
 			goto ktext_open_quit_write_sem_up;
 		}
+		fs->reserved = true;
 	}
 
-	/* "trust no one", private_data contains the whole text */
-	filp->private_data = NULL;
+	if (write_mode) {
+		status = ktext_open_quota(filp);
+		if (unlikely(status != 0)) {
+			fs = (fops_status_t *) filp->private_data;
+			if (fs) {
+				if (fs->reserved)
+					ktext_unreserve(ktext);
+				fops_status_destroy(fs);
+				filp->private_data = NULL;
+			}
+			goto ktext_open_quit_write_sem_up;
+		}
+	}
 
 	goto ktext_open_quit;
 
@@ -196,6 +466,78 @@ ktext_open_quit:
 	return status;
 }
 
+/**
+ * ktext_push_framed() - push the texts of a framed writer
+ *
+ * @fs:		the fops_status_t object of the writer
+ * @ttl:	time-to-live in jiffies, 0 for none
+ *
+ * fs->text holds a sequence of texts, each one preceded by its
+ * length as a host endian __u32, pushed one by one with the
+ * writer priority level and time-to-live. The slot reserved by
+ * ktext_open(), if any, goes to the first one. A truncated text
+ * at the end is dropped. Stops at the first error.
+ * Each text costs a message token: the first one has been paid
+ * by ktext_open(), the others are admitted here. Once over quota,
+ * the rest is dropped, and -EAGAIN returned with quota_policy=0.
+ *
+ */
+static int
+ktext_push_framed(fops_status_t *fs, unsigned long ttl)
+{
+	int status;
+	loff_t off;
+	__u32 len;
+	bool reserved;
+	bool first;
+	bool over;
+
+	status = 0;
+	off = 0;
+	reserved = fs->reserved;
+	first = true;
+	over = false;
+	while (fs->count - off >= sizeof(len)) {
+		memcpy(&len, fs->text + off, sizeof(len));
+		off += sizeof(len);
+		if (len > fs->count - off)
+			break;
+		/* bytes were charged on close() already */
+		if (!over && !first && fs->quota &&
+				!ktext_quota_admit(ktext_quotas, fs->quota,
+					quota_msgs, 0, ktext_max_resident())) {
+			over = true;
+			if (quota_policy == KTEXT_QUOTA_REJECT)
+				status = -EAGAIN;
+		}
+		first = false;
+		if (over) {
+			ktext_count_dropped(ktext);
+			off += len;
+			continue;
+		}
+		status = ktext_push(ktext, fs->text + off, len, fs->prio,
+				ttl, reserved, fs->quota);
+		reserved = false;
+		if (status < 0)
+			goto ktext_push_framed_quit;
+		off += len;
+	}
+	if (off != fs->count) {
+#ifdef KTEXT_DEBUG
+		printk(KERN_NOTICE "ktext_push_framed: dropping %lld "
+				"trailing bytes\n", fs->count - off);
+#endif
+		ktext_count_dropped(ktext);
+	}
+
+ktext_push_framed_quit:
+	if (reserved)
+		/* not even one text */
+		ktext_unreserve(ktext);
+	return status;
+}
+
 /**
  * ktext_release() - the file_operations.release function.
  *
@@ -212,6 +554,7 @@ ktext_release(struct inode *inode, struct file *filp)
 	fops_status_t *fs;
 	bool write_mode;
 	int status;
+	unsigned int ttl;
 
 	/* simmetric to ktext_open(), if write_mode, account
 	 * the written data (to private_data) to the list.
@@ -230,19 +573,38 @@ ktext_release(struct inode *inode, struct file *filp)
 	}
 #endif
 
-	/* store private_data as a NULL terminated string
+	/* store private_data, fs->count bytes long,
 	 * to our list.
 	 */
-	if (write_mode && fs) {
-		status = ktext_push(ktext, fs->text, fs->count);
+	if (write_mode && fs && fs->quota)
+		ktext_quota_charge(ktext_quotas, fs->quota, fs->count, quota_bytes);
+
+	if (write_mode && fs && fs->throttled) {
+		/* over quota, with quota_policy=1 */
+		if (fs->reserved)
+			ktext_unreserve(ktext);
+		ktext_count_dropped(ktext);
+	} else if (write_mode && fs && fs->count == 0) {
+		/* opened and closed, nothing written, nothing to push */
+		if (fs->reserved)
+			ktext_unreserve(ktext);
+	} else if (write_mode && fs && fs->framing) {
+		ttl = fs->ttl ? fs->ttl : default_ttl;
+		status = ktext_push_framed(fs, msecs_to_jiffies(ttl));
+	} else if (write_mode && fs) {
+		ttl = fs->ttl ? fs->ttl : default_ttl;
+		status = ktext_push(ktext, fs->text, fs->count, fs->prio,
+				msecs_to_jiffies(ttl), fs->reserved, fs->quota);
 #ifdef KTEXT_DEBUG
 		printk(KERN_NOTICE "ktext_release: inode: %p - file: %p. "
-				"write: true, pushing: %s, status: %d\n",
-				inode, filp, fs->text, status);
+				"write: true, pushing: %.*s, status: %d\n",
+				inode, filp, (int) fs->count, fs->text, status);
 #endif
 	}
 
 	if (fs) {
+		if (fs->quota)
+			ktext_quota_put(fs->quota);
 		fops_status_destroy(fs);
 		fs = NULL;
 		filp->private_data = NULL;
@@ -254,6 +616,86 @@ ktext_release(struct inode *inode, struct file *filp)
 	return status;
 }
 
+/**
+ * ktext_read_framed() - read() in streaming mode.
+ *
+ * @fs:		the fops_status_t object of the reader
+ * @buf:	the userspace buffer
+ * @count:	the buffer size
+ *
+ * Pop as many strings as they fit into @buf, framing each
+ * one according to fs->framing, preceded by its sequence
+ * number if leased. Only whole strings are
+ * handed to userspace: the first one not fitting is left
+ * at the head of the FIFO, if not even one does -EMSGSIZE
+ * is returned.
+ * A string that can't be copied to @buf is put back at the head
+ * if leased, accounted in n_dropped otherwise, as in
+ * ktext_read_stream().
+ *
+ */
+static ssize_t
+ktext_read_framed(fops_status_t *fs, char __user *buf, size_t count)
+{
+	size_t done;
+	int status;
+	size_t overhead;
+	size_t seq_len;
+	size_t len;
+	__u32 len32;
+	__u64 seq;
+	char delim;
+
+	done = 0;
+	if (fs->framing == KTEXT_FRAMING_LENGTH)
+		overhead = sizeof(len32);
+	else
+		overhead = 1;
+	seq_len = fs->lease ? sizeof(seq) : 0;
+	overhead += seq_len;
+	delim = (fs->framing == KTEXT_FRAMING_NEWLINE) ? '\n' : '\0';
+	/* the framing can't be changed anymore */
+	fs->popped = true;
+
+	while (count - done > overhead) {
+		status = ktext_pop_into(ktext, fs->text,
+				min(count - done - overhead, KTEXT_RECORD_SIZE), &len,
+				msecs_to_jiffies(fs->lease), &seq);
+		if (status == -EMSGSIZE && done > 0)
+			break;
+		if (status < 0)
+			return done ? (ssize_t) done : status;
+		if (status == 0)
+			/* FIFO drained */
+			break;
+
+		/* popped into fs->text */
+		status = 0;
+		if (seq_len && copy_to_user(buf + done, &seq, seq_len))
+			status = -EFAULT;
+		else if (fs->framing == KTEXT_FRAMING_LENGTH) {
+			len32 = len;
+			if (copy_to_user(buf + done + seq_len, &len32, sizeof(len32)) ||
+					copy_to_user(buf + done + overhead, fs->text, len))
+				status = -EFAULT;
+		} else {
+			if (copy_to_user(buf + done + seq_len, fs->text, len) ||
+					put_user(delim, buf + done + seq_len + len))
+				status = -EFAULT;
+		}
+		if (status != 0) {
+			if (fs->lease)
+				ktext_lease_end(ktext, seq, seq, true);
+			else
+				ktext_count_dropped(ktext);
+			return done ? (ssize_t) done : status;
+		}
+		done += len + overhead;
+	}
+
+	return done;
+}
+
 /**
  * ktext_read() - the file_operations.read function.
  *
@@ -265,6 +707,9 @@ ktext_release(struct inode *inode, struct file *filp)
  * Read one single string from the FIFO until the end.
  * On every ktext_open(), a new string will be popped
  * out from the FIFO and fed to stinky userspace, that's it.
+ * Unless a framing mode has been set through
+ * KTEXT_IOC_SET_FRAMING, see ktext_read_framed().
+ * If leased, the string is preceded by its sequence number.
  *
  */
 static ssize_t
@@ -275,10 +720,11 @@ ktext_read(struct file *filp, char __user *buf,
 	fops_status_t *fs;
 	size_t buf_len;
 	size_t to_read_len;
-	char *text;
+	size_t len;
+	size_t seq_len;
+	__u64 seq;
 
 	status = 0;
-	text = NULL;
 
 #ifdef KTEXT_DEBUG
 	printk(KERN_NOTICE "ktext_read: file: %p. "
@@ -286,55 +732,322 @@ ktext_read(struct file *filp, char __user *buf,
 			filp, filp->private_data);
 #endif
 
-	fs = (fops_status_t *) filp->private_data;
-	if (fs == NULL) {
-		status = fops_status_init(&fs, false);
-		if (status != 0)
-			goto ktext_read_quit;
+	status = ktext_fops_status(filp, &fs);
+	if (status != 0)
+		goto ktext_read_quit;
 
-		if (fs->text != NULL) {
-			BUG_ON(fs->text);
-			BUG();
-		}
+	if (fs->framing != KTEXT_FRAMING_NONE)
+		return ktext_read_framed(fs, buf, count);
 
-		/* get the first string on the FIFO */
-		status = ktext_pop(ktext, &text);
-		if (status != 0)
+	if (!fs->popped) {
+		/* get the first string on the FIFO, into our buffer,
+		 * after its sequence number if leased */
+		seq_len = fs->lease ? sizeof(seq) : 0;
+		status = ktext_pop_into(ktext, fs->text + seq_len,
+				KTEXT_RECORD_SIZE, &len,
+				msecs_to_jiffies(fs->lease), &seq);
+		if (status < 0)
 			goto ktext_read_quit;
+		if (status > 0 && seq_len) {
+			memcpy(fs->text, &seq, seq_len);
+			len += seq_len;
+		}
+		status = 0;
 
-		/* ignore NULL pointer above, attach our string to fs below */
-		fs->text = text;
+		fs->popped = true;
 		fs->count = 0;
-		if (text)
-			fs->read_text_strlen = strlen(fs->text);
-		else
-			fs->read_text_strlen = 0;
-
-		filp->private_data = fs;
+		fs->read_text_len = len;
 	}
 
-	if (fs->text == NULL)
-		/* nothing to read */
-		goto ktext_read_quit;
-
 	/* NOTE: do not account the NULL terminator on read,
 	 * it doesn't look nice */
-	buf_len = fs->read_text_strlen;
+	buf_len = fs->read_text_len;
 	to_read_len = buf_len - fs->count;
 	if (to_read_len < 1)
 		/* nothing to read */
 		goto ktext_read_quit;
 
-	if (to_read_len > count)
-		to_read_len = count;
-
-	status = simple_read_from_buffer(buf, to_read_len, &fs->count,
-			fs->text, to_read_len);
+	status = simple_read_from_buffer(buf, count, &fs->count,
+			fs->text, buf_len);
 
 ktext_read_quit:
 	return status;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+
+/**
+ * ktext_iter_seg_len() - length of the current segment of an iov_iter
+ *
+ * @i:		the iov_iter object
+ *
+ */
+static size_t
+ktext_iter_seg_len(const struct iov_iter *i)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+	if (iter_is_iovec(i))
+		return min(iov_iter_count(i), iter_iov_len(i));
+	return iov_iter_count(i);
+#else
+	return iov_iter_single_seg_count(i);
+#endif
+}
+
+/**
+ * ktext_iter_is_user() - is the iov_iter backed by userspace memory?
+ *
+ * @i:		the iov_iter object
+ *
+ * Pipes (splice(), sendfile()) and kernel buffers are not.
+ */
+static bool
+ktext_iter_is_user(const struct iov_iter *i)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	return user_backed_iter(i);
+#else
+	return iter_is_iovec(i);
+#endif
+}
+
+/**
+ * ktext_read_stream() - read_iter() into a kernel iov_iter
+ *
+ * @fs:		the fops_status_t object of the reader
+ * @to:		the destination iov_iter object
+ *
+ * splice() and sendfile(): pop as many strings as they fit,
+ * framed as in ktext_read_framed(), KTEXT_FRAMING_LENGTH being
+ * used in place of KTEXT_FRAMING_NONE.
+ * A string that fits but can't be copied out (which kernel buffers
+ * shouldn't do) is put back at the head if leased, or accounted in
+ * n_dropped otherwise, its partial frame left in @to.
+ *
+ */
+static ssize_t
+ktext_read_stream(fops_status_t *fs, struct iov_iter *to)
+{
+	size_t done;
+	int status;
+	unsigned int framing;
+	size_t overhead;
+	size_t seq_len;
+	size_t copied;
+	size_t len;
+	__u32 len32;
+	__u64 seq;
+	char delim;
+
+	framing = fs->framing;
+	if (framing == KTEXT_FRAMING_NONE)
+		framing = KTEXT_FRAMING_LENGTH;
+	if (framing == KTEXT_FRAMING_LENGTH)
+		overhead = sizeof(len32);
+	else
+		overhead = 1;
+	seq_len = fs->lease ? sizeof(seq) : 0;
+	overhead += seq_len;
+	delim = (framing == KTEXT_FRAMING_NEWLINE) ? '\n' : '\0';
+	/* the framing can't be changed anymore */
+	fs->popped = true;
+
+	done = 0;
+	while (iov_iter_count(to) > overhead) {
+		status = ktext_pop_into(ktext, fs->text,
+				min(iov_iter_count(to) - overhead, KTEXT_RECORD_SIZE),
+				&len, msecs_to_jiffies(fs->lease), &seq);
+		if (status == -EMSGSIZE && done > 0)
+			break;
+		if (status < 0)
+			return done ? (ssize_t) done : status;
+		if (status == 0)
+			/* FIFO drained */
+			break;
+
+		/* popped into fs->text */
+		copied = copy_to_iter(&seq, seq_len, to);
+		if (framing == KTEXT_FRAMING_LENGTH) {
+			len32 = len;
+			copied += copy_to_iter(&len32, sizeof(len32), to);
+			copied += copy_to_iter(fs->text, len, to);
+		} else {
+			copied += copy_to_iter(fs->text, len, to);
+			copied += copy_to_iter(&delim, 1, to);
+		}
+		if (copied != len + overhead) {
+			if (fs->lease)
+				ktext_lease_end(ktext, seq, seq, true);
+			else
+				ktext_count_dropped(ktext);
+			return done ? (ssize_t) done : -EFAULT;
+		}
+		done += copied;
+	}
+
+	return done;
+}
+
+/**
+ * ktext_write_iter() - the file_operations.write_iter function.
+ *
+ * @iocb:	the kiocb object
+ * @from:	the source iov_iter object
+ *
+ * Same as ktext_write(), for writev() and splice() from a pipe.
+ * Whatever doesn't fit is ignored.
+ *
+ */
+static ssize_t
+ktext_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	int status;
+	fops_status_t *fs;
+	size_t count;
+	size_t free_buf;
+	size_t copied;
+
+	status = ktext_fops_status(iocb->ki_filp, &fs);
+	if (status != 0)
+		return status;
+
+	count = iov_iter_count(from);
+	free_buf = fs->total - fs->count; /* binary safe, no \0 needed */
+	copied = copy_from_iter(fs->text + fs->count, min(count, free_buf), from);
+	fs->count += copied;
+	if (copied < min(count, free_buf))
+		return copied ? (ssize_t) copied : -EFAULT;
+	/* truncated, like ktext_write() */
+	return count;
+}
+
+/**
+ * ktext_read_iter() - the file_operations.read_iter function.
+ *
+ * @iocb:	the kiocb object
+ * @to:		the destination iov_iter object
+ *
+ * readv(): pop one string per iovec (up to KTEXT_READV_BATCH, and
+ * as many as fit in fs->text), all of them under a single FIFO lock
+ * acquisition, without allocating. Each string is
+ * framed, at the start of its own iovec, according to fs->framing,
+ * KTEXT_FRAMING_LENGTH being used in place of KTEXT_FRAMING_NONE,
+ * preceded by its sequence number if leased.
+ * The batch stops at the first string not fitting its iovec (it is
+ * left at the head of the FIFO), -EMSGSIZE if that's the first one.
+ * The return value is the sum of the framed strings lengths, the
+ * unused tail of each iovec is not accounted.
+ * The batch is leased (see KTEXT_COPY_LEASE) until copied out,
+ * strings that could not be are put back at the head of the FIFO.
+ * Kernel iov_iters (splice(), sendfile()) are handed to
+ * ktext_read_stream() instead.
+ *
+ */
+static ssize_t
+ktext_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t status;
+	fops_status_t *fs;
+	struct ktext_record *recs;
+	struct iov_iter segs;
+	unsigned int framing;
+	unsigned int nr;
+	unsigned int i;
+	size_t overhead;
+	size_t seq_len;
+	size_t seg;
+	size_t done;
+	__u32 len32;
+	char delim;
+
+	status = ktext_fops_status(iocb->ki_filp, &fs);
+	if (status != 0)
+		return status;
+	if (fs->read_text_len > fs->count)
+		/* in the middle of a plain read() */
+		return -EBUSY;
+	if (!ktext_iter_is_user(to))
+		return ktext_read_stream(fs, to);
+
+	framing = fs->framing;
+	if (framing == KTEXT_FRAMING_NONE)
+		framing = KTEXT_FRAMING_LENGTH;
+	if (framing == KTEXT_FRAMING_LENGTH)
+		overhead = sizeof(len32);
+	else
+		overhead = 1;
+	seq_len = fs->lease ? sizeof(recs->seq) : 0;
+	overhead += seq_len;
+	delim = (framing == KTEXT_FRAMING_NEWLINE) ? '\n' : '\0';
+
+	recs = kmalloc(sizeof(struct ktext_record) * KTEXT_READV_BATCH,
+			GFP_KERNEL);
+	if (recs == NULL)
+		return -ENOMEM;
+
+	/* size up the iovecs, without consuming @to */
+	segs = *to;
+	for (nr = 0; nr < KTEXT_READV_BATCH && iov_iter_count(&segs) > 0; nr++) {
+		seg = ktext_iter_seg_len(&segs);
+		if (seg <= overhead)
+			/* not even room for the framing */
+			break;
+		recs[nr].text = NULL;
+		recs[nr].len = seg - overhead;
+		iov_iter_advance(&segs, seg);
+	}
+
+	status = ktext_pop_batch_into(ktext, recs, nr, fs->text, KTEXT_READ_SIZE,
+			msecs_to_jiffies(fs->lease ? fs->lease :
+				KTEXT_COPY_LEASE));
+	if (status < 0)
+		goto ktext_read_iter_quit;
+	nr = status;
+	/* the framing can't be changed anymore */
+	fs->popped = true;
+
+	done = 0;
+	status = 0;
+	for (i = 0; i < nr && status == 0; i++) {
+		seg = ktext_iter_seg_len(to);
+		if (seq_len && copy_to_iter(&recs[i].seq, seq_len, to) != seq_len)
+			status = -EFAULT;
+		else if (framing == KTEXT_FRAMING_LENGTH) {
+			len32 = recs[i].len;
+			if (copy_to_iter(&len32, sizeof(len32), to) != sizeof(len32) ||
+					copy_to_iter(recs[i].text, recs[i].len, to)
+					!= recs[i].len)
+				status = -EFAULT;
+		} else {
+			if (copy_to_iter(recs[i].text, recs[i].len, to)
+					!= recs[i].len ||
+					copy_to_iter(&delim, 1, to) != 1)
+				status = -EFAULT;
+		}
+		if (status != 0)
+			break;
+		done += recs[i].len + overhead;
+		/* next string, next iovec */
+		if (i + 1 < nr)
+			iov_iter_advance(to, seg - recs[i].len - overhead);
+	}
+	if (done)
+		status = done;
+
+	if (i < nr)
+		/* not copied out, back at the head */
+		ktext_lease_end(ktext, recs[i].seq, recs[nr - 1].seq, true);
+	if (!fs->lease && i > 0)
+		/* delivered, the reader has no lease of its own */
+		ktext_lease_end(ktext, recs[0].seq, recs[i - 1].seq, false);
+
+ktext_read_iter_quit:
+	kfree(recs);
+	return status;
+}
+
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
 
 /* commit 6a727b43be8b005609e893a80af980808012cfdb */
@@ -406,13 +1119,9 @@ ktext_write(struct file *filp, const char __user *ubuf,
 			filp, filp->private_data);
 #endif
 
-	fs = (fops_status_t *) filp->private_data;
-	if (fs == NULL) {
-		status = fops_status_init(&fs, true);
-		if (status != 0)
-			goto ktext_write_quit;
-		filp->private_data = fs;
-	}
+	status = ktext_fops_status(filp, &fs);
+	if (status != 0)
+		goto ktext_write_quit;
 
 #ifdef KTEXT_DEBUG
 	printk(KERN_NOTICE "ktext_write: file: %p. "
@@ -420,7 +1129,7 @@ ktext_write(struct file *filp, const char __user *ubuf,
 			filp, fs, filp->private_data);
 #endif
 
-	free_buf = fs->total - fs->count - 1; /* keep \0 at the end */
+	free_buf = fs->total - fs->count; /* binary safe, no \0 needed */
 	if (free_buf == 0) {
 		/* no more space, ignore the rest of the data from user
 		 * in other words, truncate -> ("yeah yeah, I've read it thanks") */
@@ -438,19 +1147,154 @@ ktext_write(struct file *filp, const char __user *ubuf,
 			"writing bytes: %zd\n", filp, count);
 #endif
 
-	return simple_write_to_buffer(fs->text, free_buf, &fs->count, ubuf, count);
+	return simple_write_to_buffer(fs->text, fs->total, &fs->count, ubuf, count);
 
 ktext_write_quit:
 	return status;
 }
 
-/* Structure that declares the usual file */
-/* access functions */
-static struct file_operations
-ktext_fops = {
-	read: ktext_read,
-	write: ktext_write,
-	open: ktext_open,
+/**
+ * ktext_ioctl() - the file_operations.unlocked_ioctl function.
+ *
+ * @filp:	the file object
+ * @cmd:	the command, see ktext_ioctl.h
+ * @arg:	the command argument
+ *
+ */
+static long
+ktext_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	long status;
+	bool write_mode;
+	fops_status_t *fs;
+	struct ktext_stats st;
+	__u32 prio;
+	__u32 ttl;
+	__u32 framing;
+	__u32 lease;
+
+	write_mode = filp->f_mode & FMODE_WRITE;
+	status = 0;
+
+	switch (cmd) {
+	case KTEXT_IOC_SET_PRIO:
+		if (!write_mode) {
+			status = -EBADF;
+			break;
+		}
+		if (get_user(prio, (__u32 __user *) arg)) {
+			status = -EFAULT;
+			break;
+		}
+		if (prio >= KTEXT_PRIO_LEVELS) {
+			status = -EINVAL;
+			break;
+		}
+		status = ktext_fops_status(filp, &fs);
+		if (status != 0)
+			break;
+		fs->prio = prio;
+		break;
+	case KTEXT_IOC_SET_TTL:
+		if (!write_mode) {
+			status = -EBADF;
+			break;
+		}
+		if (get_user(ttl, (__u32 __user *) arg)) {
+			status = -EFAULT;
+			break;
+		}
+		status = ktext_fops_status(filp, &fs);
+		if (status != 0)
+			break;
+		fs->ttl = ttl;
+		break;
+	case KTEXT_IOC_SET_FRAMING:
+		if (get_user(framing, (__u32 __user *) arg)) {
+			status = -EFAULT;
+			break;
+		}
+		if (framing > KTEXT_FRAMING_LENGTH) {
+			status = -EINVAL;
+			break;
+		}
+		if (write_mode && framing != KTEXT_FRAMING_NONE &&
+				framing != KTEXT_FRAMING_LENGTH) {
+			/* texts may contain any byte */
+			status = -EINVAL;
+			break;
+		}
+		status = ktext_fops_status(filp, &fs);
+		if (status != 0)
+			break;
+		if (write_mode && fs->count) {
+			/* too late, already writing one string */
+			status = -EBUSY;
+			break;
+		}
+		if (fs->popped) {
+			/* too late, already reading one string */
+			status = -EBUSY;
+			break;
+		}
+		fs->framing = framing;
+		break;
+	case KTEXT_IOC_SET_LEASE:
+		if (write_mode) {
+			status = -EBADF;
+			break;
+		}
+		if (get_user(lease, (__u32 __user *) arg)) {
+			status = -EFAULT;
+			break;
+		}
+		status = ktext_fops_status(filp, &fs);
+		if (status != 0)
+			break;
+		if (fs->popped) {
+			/* too late, already reading one string */
+			status = -EBUSY;
+			break;
+		}
+		fs->lease = lease;
+		break;
+	case KTEXT_IOC_GET_STATS:
+		status = ktext_get_stats(ktext, &st);
+		if (status != 0)
+			break;
+		if (copy_to_user((void __user *) arg, &st, sizeof(st)))
+			status = -EFAULT;
+		break;
+	default:
+		status = -ENOTTY;
+	}
+
+	return status;
+}
+
+/* Structure that declares the usual file */
+/* access functions */
+static struct file_operations
+ktext_fops = {
+	owner: THIS_MODULE,
+	read: ktext_read,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+	read_iter: ktext_read_iter,
+	write_iter: ktext_write_iter,
+	splice_write: iter_file_splice_write,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+	splice_read: copy_splice_read,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+	/* read_iter() on a pipe iov_iter */
+	splice_read: generic_file_splice_read,
+#endif
+	write: ktext_write,
+	unlocked_ioctl: ktext_ioctl,
+#ifdef CONFIG_COMPAT
+	compat_ioctl: ktext_ioctl,
+#endif
+	open: ktext_open,
 	release: ktext_release
 };
 
@@ -458,6 +1302,692 @@ static struct miscdevice ktext_device = {
   MISC_DYNAMIC_MINOR, "ktext", &ktext_fops
 };
 
+/**
+ * ktext_ctl_peek() - KTEXT_IOC_PEEK implementation
+ *
+ * @arg:	the struct ktext_peek userspace pointer
+ *
+ */
+static long
+ktext_ctl_peek(unsigned long arg)
+{
+	long status;
+	struct ktext_peek pk;
+	char *buf;
+	size_t len;
+	unsigned int prio;
+	unsigned long queued;
+
+	if (copy_from_user(&pk, (void __user *) arg, sizeof(pk)))
+		return -EFAULT;
+
+	/* no record is longer than KTEXT_RECORD_SIZE */
+	len = min_t(__u64, pk.len, KTEXT_RECORD_SIZE);
+	buf = kmalloc(len + 1, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	status = ktext_peek(ktext, pk.index, buf, &len, &prio, &queued);
+	if (status != 0)
+		goto ktext_ctl_peek_quit;
+
+	if (copy_to_user((void __user *) (unsigned long) pk.buf, buf,
+				min_t(__u64, pk.len, len))) {
+		status = -EFAULT;
+		goto ktext_ctl_peek_quit;
+	}
+	pk.len = len;
+	pk.prio = prio;
+	pk.age_ms = jiffies_to_msecs(jiffies - queued);
+	if (copy_to_user((void __user *) arg, &pk, sizeof(pk)))
+		status = -EFAULT;
+
+ktext_ctl_peek_quit:
+	kfree(buf);
+	return status;
+}
+
+/**
+ * ktext_ctl_peek_range() - KTEXT_IOC_PEEK_RANGE implementation
+ *
+ * @arg:	the struct ktext_peek_range userspace pointer
+ *
+ */
+static long
+ktext_ctl_peek_range(unsigned long arg)
+{
+	long status;
+	struct ktext_peek_range pr;
+	char *buf;
+	size_t size;
+	size_t len;
+
+	if (copy_from_user(&pr, (void __user *) arg, sizeof(pr)))
+		return -EFAULT;
+
+	size = min_t(__u64, pr.len, KTEXT_DUMP_CHUNK);
+	buf = vmalloc(size);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	status = ktext_peek_range(ktext, pr.first, pr.count, buf, size, &len);
+	if (status < 0)
+		goto ktext_ctl_peek_range_quit;
+
+	if (copy_to_user((void __user *) (unsigned long) pr.buf, buf, len)) {
+		status = -EFAULT;
+		goto ktext_ctl_peek_range_quit;
+	}
+	pr.count = status;
+	pr.len = len;
+	status = 0;
+	if (copy_to_user((void __user *) arg, &pr, sizeof(pr)))
+		status = -EFAULT;
+
+ktext_ctl_peek_range_quit:
+	vfree(buf);
+	return status;
+}
+
+/**
+ * ktext_ctl_watermarks() - KTEXT_IOC_SET_WATERMARKS implementation
+ *
+ * @arg:	the struct ktext_watermarks userspace pointer
+ *
+ */
+static long
+ktext_ctl_watermarks(unsigned long arg)
+{
+	long status;
+	struct ktext_watermarks wm;
+	struct eventfd_ctx *high_ctx;
+	struct eventfd_ctx *low_ctx;
+
+	if (copy_from_user(&wm, (void __user *) arg, sizeof(wm)))
+		return -EFAULT;
+
+	high_ctx = NULL;
+	low_ctx = NULL;
+	status = 0;
+
+	if ((wm.flags & ~KTEXT_WM_BYTES) || wm.pad)
+		return -EINVAL;
+	if ((wm.high_fd < 0) && (wm.low_fd < 0)) {
+		/* off */
+		ktext_set_watermarks(ktext, NULL, NULL, 0, 0, false);
+		return 0;
+	}
+	if (wm.low >= wm.high)
+		return -EINVAL;
+
+	if (wm.high_fd >= 0) {
+		high_ctx = eventfd_ctx_fdget(wm.high_fd);
+		if (IS_ERR(high_ctx)) {
+			status = PTR_ERR(high_ctx);
+			high_ctx = NULL;
+			goto ktext_ctl_watermarks_quit;
+		}
+	}
+	if (wm.low_fd >= 0) {
+		low_ctx = eventfd_ctx_fdget(wm.low_fd);
+		if (IS_ERR(low_ctx)) {
+			status = PTR_ERR(low_ctx);
+			low_ctx = NULL;
+			goto ktext_ctl_watermarks_quit;
+		}
+	}
+
+	/* references taken over */
+	ktext_set_watermarks(ktext, high_ctx, low_ctx, wm.high, wm.low,
+			wm.flags & KTEXT_WM_BYTES);
+	return 0;
+
+ktext_ctl_watermarks_quit:
+	if (high_ctx)
+		eventfd_ctx_put(high_ctx);
+	return status;
+}
+
+/**
+ * ktext_ctl_export() - KTEXT_IOC_EXPORT implementation
+ *
+ * @arg:	the struct ktext_dump userspace pointer
+ *
+ * Exports KTEXT_DUMP_CHUNK bytes at a time, each chunk copied out
+ * before the next one is popped. Chunks are leased (see
+ * KTEXT_COPY_LEASE) until copied out, and put back at the head of
+ * the FIFO if that fails.
+ */
+static long
+ktext_ctl_export(unsigned long arg)
+{
+	long status;
+	struct ktext_dump d;
+	char __user *ubuf;
+	char *buf;
+	size_t done;
+	size_t len;
+	u64 first;
+
+	if (copy_from_user(&d, (void __user *) arg, sizeof(d)))
+		return -EFAULT;
+	ubuf = (char __user *) (unsigned long) d.addr;
+
+	buf = vmalloc(KTEXT_DUMP_CHUNK);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	status = 0;
+	done = 0;
+	d.n_texts = 0;
+	while (done < d.len) {
+		status = ktext_export(ktext, buf,
+				min_t(__u64, d.len - done, KTEXT_DUMP_CHUNK), &len,
+				msecs_to_jiffies(KTEXT_COPY_LEASE), &first);
+		if (status <= 0)
+			break;
+		if (copy_to_user(ubuf + done, buf, len)) {
+			/* back at the head, for the next call */
+			ktext_lease_end(ktext, first, first + status - 1, true);
+			status = -EFAULT;
+			break;
+		}
+		ktext_lease_end(ktext, first, first + status - 1, false);
+		done += len;
+		d.n_texts += status;
+	}
+	if ((status == -EMSGSIZE || status == -EFAULT) && done > 0)
+		/* the next text is for the next call */
+		status = 0;
+	if (status < 0)
+		goto ktext_ctl_export_quit;
+
+	status = 0;
+	d.len = done;
+	if (copy_to_user((void __user *) arg, &d, sizeof(d)))
+		status = -EFAULT;
+
+ktext_ctl_export_quit:
+	vfree(buf);
+	return status;
+}
+
+/**
+ * ktext_ctl_import() - KTEXT_IOC_IMPORT implementation
+ *
+ * @arg:	the struct ktext_dump userspace pointer
+ *
+ * Imports KTEXT_DUMP_CHUNK bytes at a time. A record crossing the
+ * end of a chunk starts the next one. d.len, d.n_texts and d.skip
+ * are written back on errors too.
+ */
+static long
+ktext_ctl_import(unsigned long arg)
+{
+	long status;
+	struct ktext_dump d;
+	const char __user *ubuf;
+	char *buf;
+	size_t done;
+	size_t len;
+	size_t used;
+	unsigned int imported;
+
+	if (copy_from_user(&d, (void __user *) arg, sizeof(d)))
+		return -EFAULT;
+	if (d.pad != 0)
+		return -EINVAL;
+	ubuf = (const char __user *) (unsigned long) d.addr;
+
+	buf = vmalloc(KTEXT_DUMP_CHUNK);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	status = 0;
+	done = 0;
+	d.n_texts = 0;
+	while (done < d.len) {
+		len = min_t(__u64, d.len - done, KTEXT_DUMP_CHUNK);
+		if (copy_from_user(buf, ubuf + done, len)) {
+			status = -EFAULT;
+			break;
+		}
+		status = ktext_import(ktext, buf, len, &used, &d.skip,
+				&imported);
+		done += used;
+		d.n_texts += imported;
+		if (status < 0)
+			break;
+		if (used == 0)
+			/* a truncated record */
+			break;
+	}
+
+	/* tell what went in anyway */
+	d.len = done;
+	if (copy_to_user((void __user *) arg, &d, sizeof(d)))
+		status = -EFAULT;
+
+	vfree(buf);
+	return status;
+}
+
+/**
+ * ktext_ctl_ioctl() - the /dev/ktext_ctl file_operations.unlocked_ioctl
+ * 		       function.
+ *
+ * @filp:	the file object
+ * @cmd:	the command, see ktext_ioctl.h
+ * @arg:	the command argument
+ *
+ * /dev/ktext_ctl doesn't take the readers/writers lock on open(),
+ * the commands here only take the FIFO lock, briefly.
+ */
+static long
+ktext_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	long status;
+	struct ktext_stats st;
+	struct ktext_query q;
+	struct ktext_ack ack;
+	struct ktext_comp_stats cst;
+
+	status = 0;
+
+	switch (cmd) {
+	case KTEXT_IOC_QUERY:
+		status = ktext_query(ktext, &q);
+		if (status != 0)
+			break;
+		if (copy_to_user((void __user *) arg, &q, sizeof(q)))
+			status = -EFAULT;
+		break;
+	case KTEXT_IOC_PEEK:
+		status = ktext_ctl_peek(arg);
+		break;
+	case KTEXT_IOC_PEEK_RANGE:
+		status = ktext_ctl_peek_range(arg);
+		break;
+	case KTEXT_IOC_SET_WATERMARKS:
+		status = ktext_ctl_watermarks(arg);
+		break;
+	case KTEXT_IOC_ACK:
+		if (copy_from_user(&ack, (void __user *) arg, sizeof(ack))) {
+			status = -EFAULT;
+			break;
+		}
+		status = ktext_ack(ktext, ack.first, ack.last);
+		break;
+	case KTEXT_IOC_GET_STATS:
+		status = ktext_get_stats(ktext, &st);
+		if (status != 0)
+			break;
+		if (copy_to_user((void __user *) arg, &st, sizeof(st)))
+			status = -EFAULT;
+		break;
+	case KTEXT_IOC_GET_COMP_STATS:
+		status = ktext_get_comp_stats(ktext, &cst);
+		if (status != 0)
+			break;
+		if (copy_to_user((void __user *) arg, &cst, sizeof(cst)))
+			status = -EFAULT;
+		break;
+	case KTEXT_IOC_EXPORT:
+		status = ktext_ctl_export(arg);
+		break;
+	case KTEXT_IOC_IMPORT:
+		status = ktext_ctl_import(arg);
+		break;
+	default:
+		status = -ENOTTY;
+	}
+
+	return status;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+
+/**
+ * struct ktext_uring_pdu - state of a KTEXT_URING_* command, kept
+ * 			    in io_uring_cmd.pdu
+ *
+ * @wl:		the list_head object, on ktext_uring_waiters while
+ * 		waiting for a text
+ * @addr:	the userspace buffer
+ * @len:	the size of @addr
+ * @op:		the KTEXT_URING_* command
+ */
+struct ktext_uring_pdu {
+	struct list_head wl;
+	__u64 addr;
+	__u32 len;
+	__u32 op;
+};
+
+/* pops waiting for a push, oldest first */
+static LIST_HEAD(ktext_uring_waiters);
+static DEFINE_SPINLOCK(ktext_uring_lock);
+/* bumped on every push, see ktext_uring_wait() */
+static atomic_t ktext_uring_gen = ATOMIC_INIT(0);
+
+static inline struct ktext_uring_pdu *
+ktext_uring_pdu(struct io_uring_cmd *cmd)
+{
+	return (struct ktext_uring_pdu *) cmd->pdu;
+}
+
+static inline struct io_uring_cmd *
+ktext_uring_cmd_of(struct ktext_uring_pdu *p)
+{
+	return (struct io_uring_cmd *) ((char *) p -
+			offsetof(struct io_uring_cmd, pdu));
+}
+
+static void
+ktext_uring_tw(struct io_uring_cmd *cmd, unsigned int issue_flags);
+
+/**
+ * ktext_uring_kick() - have the oldest waiting pop try again
+ *
+ * Any context. The pop runs as task work of its submitter.
+ *
+ */
+static void
+ktext_uring_kick(void)
+{
+	struct ktext_uring_pdu *p;
+	unsigned long flags;
+
+	p = NULL;
+	spin_lock_irqsave(&ktext_uring_lock, flags);
+	if (!list_empty(&ktext_uring_waiters)) {
+		p = list_first_entry(&ktext_uring_waiters,
+				struct ktext_uring_pdu, wl);
+		list_del_init(&p->wl);
+	}
+	spin_unlock_irqrestore(&ktext_uring_lock, flags);
+
+	if (p)
+		io_uring_cmd_complete_in_task(ktext_uring_cmd_of(p), ktext_uring_tw);
+}
+
+static int
+ktext_uring_notify(struct notifier_block *nb, unsigned long prio, void *data)
+{
+	atomic_inc(&ktext_uring_gen);
+	ktext_uring_kick();
+	return NOTIFY_OK;
+}
+
+static struct notifier_block ktext_uring_nb = {
+	notifier_call: ktext_uring_notify
+};
+
+/**
+ * ktext_uring_try_pop() - pop into the buffer of a command
+ *
+ * @p:		the command state
+ * @res:	where to store the number of bytes filled
+ *
+ * Each text is leased (see KTEXT_COPY_LEASE) until copied out,
+ * and put back at the head of the FIFO if that fails.
+ * Returns 1 if something has been popped, 0 if the FIFO is
+ * empty, <0 on errors.
+ *
+ */
+static int
+ktext_uring_try_pop(struct ktext_uring_pdu *p, size_t *res)
+{
+	char __user *ubuf;
+	char *buf;
+	size_t overhead;
+	size_t done;
+	size_t len;
+	__u32 len32;
+	__u64 seq;
+	int popped;
+	int status;
+
+	ubuf = u64_to_user_ptr(p->addr);
+	overhead = (p->op == KTEXT_URING_POP_BATCH) ? sizeof(len32) : 0;
+	buf = kmalloc(KTEXT_RECORD_SIZE, GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	done = 0;
+	popped = 0;
+	status = 0;
+	do {
+		if (p->len - done < overhead)
+			break;
+		status = ktext_pop_into(ktext, buf,
+				min_t(size_t, p->len - done - overhead, KTEXT_RECORD_SIZE),
+				&len, msecs_to_jiffies(KTEXT_COPY_LEASE), &seq);
+		if (status <= 0)
+			break;
+		len32 = len;
+		if (copy_to_user(ubuf + done, &len32, overhead) ||
+				copy_to_user(ubuf + done + overhead, buf, len)) {
+			/* back at the head */
+			ktext_lease_end(ktext, seq, seq, true);
+			status = -EFAULT;
+			break;
+		}
+		ktext_lease_end(ktext, seq, seq, false);
+		done += overhead + len;
+		popped++;
+	} while (p->op == KTEXT_URING_POP_BATCH);
+	kfree(buf);
+
+	*res = done;
+	if (popped)
+		return 1;
+	return status;
+}
+
+/**
+ * ktext_uring_wait() - complete a pop, or park it until a push
+ *
+ * @cmd:	the io_uring_cmd object, marked cancelable
+ * @issue_flags:	the io_uring issue flags
+ *
+ * A push landing between the failed attempt and the parking is
+ * caught by ktext_uring_gen, checked under ktext_uring_lock.
+ * After a successful pop, the next waiter is kicked, in case
+ * there is more.
+ *
+ */
+static void
+ktext_uring_wait(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	struct ktext_uring_pdu *p;
+	unsigned long flags;
+	size_t res;
+	int status;
+	int gen;
+
+	p = ktext_uring_pdu(cmd);
+	for (;;) {
+		gen = atomic_read(&ktext_uring_gen);
+		status = ktext_uring_try_pop(p, &res);
+		if (status != 0) {
+			if (status > 0) {
+				status = res;
+				ktext_uring_kick();
+			}
+			io_uring_cmd_done(cmd, status, 0, issue_flags);
+			return;
+		}
+
+		spin_lock_irqsave(&ktext_uring_lock, flags);
+		if (atomic_read(&ktext_uring_gen) == gen) {
+			list_add_tail(&p->wl, &ktext_uring_waiters);
+			spin_unlock_irqrestore(&ktext_uring_lock, flags);
+			return;
+		}
+		/* pushed meanwhile */
+		spin_unlock_irqrestore(&ktext_uring_lock, flags);
+	}
+}
+
+static void
+ktext_uring_tw(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	if (current->flags & (PF_EXITING | PF_KTHREAD)) {
+		/* not in the submitter context, no buffer to fill */
+		io_uring_cmd_done(cmd, -ECANCELED, 0, issue_flags);
+		return;
+	}
+	ktext_uring_wait(cmd, issue_flags);
+}
+
+/**
+ * ktext_uring_push() - KTEXT_URING_PUSH implementation
+ *
+ * @c:		the command payload
+ *
+ * Same rules as a /dev/ktext writer: max_elements=, full_policy=
+ * and the quotas of the submitting process apply. The command
+ * runs in the submitter context, or in one of its io_uring
+ * workers, sharing its tgid.
+ */
+static int
+ktext_uring_push(const struct ktext_uring_cmd *c)
+{
+	void *buf;
+	__u32 len;
+	__u32 prio;
+	ktext_quota_t *q;
+	bool throttled;
+	int status;
+
+	len = READ_ONCE(c->len);
+	prio = READ_ONCE(c->prio);
+	if (len > KTEXT_SIZE)
+		return -EMSGSIZE;
+	if (prio >= KTEXT_PRIO_LEVELS)
+		return -EINVAL;
+
+	buf = memdup_user(u64_to_user_ptr(READ_ONCE(c->addr)), len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	status = ktext_writer_quota(&q, &throttled);
+	if (status != 0)
+		goto ktext_uring_push_quit;
+
+	if (throttled) {
+		/* quota_policy=1 */
+		ktext_count_dropped(ktext);
+		goto ktext_uring_push_quit_put;
+	}
+	if (!ktext_reserve(ktext)) {
+		status = -ENOSPC;
+		goto ktext_uring_push_quit_put;
+	}
+	if (q)
+		ktext_quota_charge(ktext_quotas, q, len, quota_bytes);
+	status = ktext_push(ktext, buf, len, prio,
+			msecs_to_jiffies(default_ttl), true, q);
+
+ktext_uring_push_quit_put:
+	if (q)
+		ktext_quota_put(q);
+ktext_uring_push_quit:
+	kfree(buf);
+	return status;
+}
+
+/**
+ * ktext_ctl_uring_cmd() - the /dev/ktext_ctl file_operations.uring_cmd
+ * 			   function.
+ *
+ * @cmd:	the io_uring_cmd object
+ * @issue_flags:	the io_uring issue flags
+ *
+ * Pops finding the FIFO empty don't block: they complete later,
+ * from the task work scheduled by the push that feeds them.
+ */
+static int
+ktext_ctl_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags)
+{
+	const struct ktext_uring_cmd *c;
+	struct ktext_uring_pdu *p;
+	unsigned long flags;
+	size_t res;
+	bool parked;
+	int status;
+
+	BUILD_BUG_ON(sizeof(struct ktext_uring_pdu) > sizeof(cmd->pdu));
+	p = ktext_uring_pdu(cmd);
+
+	if (issue_flags & IO_URING_F_CANCEL) {
+		spin_lock_irqsave(&ktext_uring_lock, flags);
+		parked = !list_empty(&p->wl);
+		if (parked)
+			list_del_init(&p->wl);
+		spin_unlock_irqrestore(&ktext_uring_lock, flags);
+		if (parked)
+			io_uring_cmd_done(cmd, -ECANCELED, 0, issue_flags);
+		return 0;
+	}
+
+	c = io_uring_sqe_cmd(cmd->sqe);
+	switch (cmd->cmd_op) {
+	case KTEXT_URING_PUSH:
+		return ktext_uring_push(c);
+	case KTEXT_URING_POP:
+	case KTEXT_URING_POP_BATCH:
+		break;
+	default:
+		return -ENOTTY;
+	}
+
+	/* the sqe can't be read after issue */
+	INIT_LIST_HEAD(&p->wl);
+	p->addr = READ_ONCE(c->addr);
+	p->len = min_t(__u32, READ_ONCE(c->len), INT_MAX);
+	p->op = cmd->cmd_op;
+
+	status = ktext_uring_try_pop(p, &res);
+	if (status > 0)
+		return res;
+	if (status < 0)
+		return status;
+
+	/* nothing there, from now on completed by io_uring_cmd_done() */
+	io_uring_cmd_mark_cancelable(cmd, issue_flags);
+	ktext_uring_wait(cmd, issue_flags);
+	return -EIOCBQUEUED;
+}
+
+#endif
+
+static struct file_operations
+ktext_ctl_fops = {
+	owner: THIS_MODULE,
+	unlocked_ioctl: ktext_ctl_ioctl,
+#ifdef CONFIG_COMPAT
+	compat_ioctl: ktext_ctl_ioctl,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+	uring_cmd: ktext_ctl_uring_cmd,
+#endif
+};
+
+static struct miscdevice ktext_ctl_device = {
+  MISC_DYNAMIC_MINOR, "ktext_ctl", &ktext_ctl_fops
+};
+
+ktext_object_t *
+ktext_queue_get(const char *name)
+{
+	if (name == NULL || strcmp(name, ktext_device.name) != 0)
+		return NULL;
+	return ktext;
+}
+EXPORT_SYMBOL_GPL(ktext_queue_get);
+
 static int __init
 ktext_init(void)
 {
@@ -471,13 +2001,82 @@ ktext_init(void)
 		status = -EINVAL;
 		goto ktext_init_quit;
 	}
-	printk(KERN_NOTICE "ktext_init: max_elements: %d, nbmode: %d\n",
-			max_elements, KTEXT_NONBLOCK_SUPPORT);
-	status = ktext_object_init(&ktext);
+	if ((full_policy < KTEXT_FULL_REJECT) || (full_policy > KTEXT_FULL_DROP_NEWEST)) {
+		printk(KERN_NOTICE "ktext: invalid full_policy= parameter (between 0 and 2)\n");
+		status = -EINVAL;
+		goto ktext_init_quit;
+	}
+	if ((fifo_node != NUMA_NO_NODE) &&
+			((fifo_node < 0) || (fifo_node >= MAX_NUMNODES) || !node_online(fifo_node))) {
+		printk(KERN_NOTICE "ktext: invalid numa_node= parameter (not online)\n");
+		status = -EINVAL;
+		goto ktext_init_quit;
+	}
+	if ((quota_policy < KTEXT_QUOTA_REJECT) || (quota_policy > KTEXT_QUOTA_DROP)) {
+		printk(KERN_NOTICE "ktext: invalid quota_policy= parameter (between 0 and 1)\n");
+		status = -EINVAL;
+		goto ktext_init_quit;
+	}
+	if (coalesce_size > KTEXT_RECORD_SIZE) {
+		printk(KERN_NOTICE "ktext: invalid coalesce_size= parameter (at most %zu)\n",
+				KTEXT_RECORD_SIZE);
+		status = -EINVAL;
+		goto ktext_init_quit;
+	}
+	if (spill_threshold < 0) {
+		printk(KERN_NOTICE "ktext: invalid spill_threshold= parameter (negative)\n");
+		status = -EINVAL;
+		goto ktext_init_quit;
+	}
+	printk(KERN_NOTICE "ktext_init: max_elements: %d, full_policy: %d, "
+			"numa_node: %d, nbmode: %d\n",
+			max_elements, full_policy, fifo_node, KTEXT_NONBLOCK_SUPPORT);
+	status = fops_status_pools_init(reserve);
 	if (status != 0)
 		goto ktext_init_quit;
+	status = ktext_quota_table_init(&ktext_quotas);
+	if (status != 0)
+		goto ktext_init_destroy_pools;
+	status = ktext_object_init(&ktext, fifo_node, reserve);
+	if (status != 0)
+		goto ktext_init_destroy_quotas;
+	ktext_set_limit(ktext, max_elements, full_policy);
+	ktext_set_spill(ktext, spill_threshold);
+	ktext_set_coalesce(ktext, coalesce_size, msecs_to_jiffies(coalesce_delay));
+	status = ktext_set_atomic_pool(ktext, atomic_pool);
+	if (status != 0)
+		goto ktext_init_destroy;
+	status = ktext_set_intern(ktext, intern_max);
+	if (status != 0)
+		goto ktext_init_destroy;
+	status = ktext_set_compress(ktext, compress_threshold);
+	if (status != 0)
+		goto ktext_init_destroy;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+	ktext_register_notifier(ktext, &ktext_uring_nb);
+#endif
 
 	status = misc_register(&ktext_device);
+	if (status != 0)
+		goto ktext_init_destroy;
+	status = misc_register(&ktext_ctl_device);
+	if (status != 0)
+		goto ktext_init_deregister;
+
+	goto ktext_init_quit;
+
+ktext_init_deregister:
+	misc_deregister(&ktext_device);
+
+ktext_init_destroy:
+	ktext_object_destroy(&ktext);
+
+ktext_init_destroy_quotas:
+	ktext_quota_table_destroy(&ktext_quotas);
+
+ktext_init_destroy_pools:
+	fops_status_pools_destroy();
 
 ktext_init_quit:
 	return status;
@@ -487,8 +2086,14 @@ static void __exit
 ktext_cleanup(void)
 {
 	printk(KERN_NOTICE "ktext_cleanup: so long and thanks for all the fish.\n");
+	misc_deregister(&ktext_ctl_device);
 	misc_deregister(&ktext_device);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+	ktext_unregister_notifier(ktext, &ktext_uring_nb);
+#endif
 	ktext_object_destroy(&ktext);
+	ktext_quota_table_destroy(&ktext_quotas);
+	fops_status_pools_destroy();
 }
 
 module_init(ktext_init);
@@ -26,7 +26,35 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/list.h>
+#include <linux/bitmap.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/notifier.h>
+#include <linux/llist.h>
+#include <linux/percpu.h>
+#include <linux/irqflags.h>
+#include <linux/numa.h>
+#include <linux/topology.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/shmem_fs.h>
+#include <linux/falloc.h>
+#include <linux/vmalloc.h>
+#include <linux/err.h>
+#include <linux/gfp.h>
+#include <linux/mempool.h>
+#include <linux/crypto.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
 #include <linux/version.h>
+#include <asm/atomic.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/signal.h>
+#endif
 
 #ifdef KTEXT_ALT_RW_STARV_PROT
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
@@ -42,19 +70,234 @@
 #include "ktext_config.h"
 #include "ktext_object.h"
 
+#ifndef READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+
+/* commit b5e618181a927210f8be1d3d2249d31904ba358d */
+
+/**
+ * list_first_entry - get the first element from a list
+ * @ptr:	the list head to take the element from.
+ * @type:	the type of the struct this is embedded in.
+ * @member:	the name of the list_struct within the struct.
+ *
+ * Note, that list is expected to be not empty.
+ */
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+
+/* lib/llist.c, since Linux 3.13 */
+
+static struct llist_node *
+llist_reverse_order(struct llist_node *head)
+{
+	struct llist_node *new_head = NULL;
+
+	while (head) {
+		struct llist_node *tmp = head;
+		head = head->next;
+		tmp->next = new_head;
+		new_head = tmp;
+	}
+
+	return new_head;
+}
+
+#endif
+
+/**
+ * struct ktext_pool - per-CPU pool of nodes for ktext_push_atomic()
+ *
+ * @free:	the free nodes, only touched by the owner CPU,
+ * 		with interrupts disabled
+ * @returned:	the nodes given back by the consumers, moved to
+ * 		@free in one go once @free runs out
+ */
+struct ktext_pool {
+	struct llist_node *free;
+	struct llist_head returned;
+};
+
+/**
+ * struct ktext_chunk - arena chunk, see KTEXT_ARENA
+ *
+ * @refs:	number of nodes in the chunk, plus one while it is
+ * 		the chunk being filled, k->prot protected
+ * @used:	bytes of @data allocated so far
+ * @data:	nodes and their texts, back to back
+ */
+struct ktext_chunk {
+	unsigned int refs;
+	size_t used;
+	char data[] __aligned(sizeof(long));
+};
+
+#define KTEXT_CHUNK_DATA_SIZE \
+	((PAGE_SIZE << KTEXT_ARENA_ORDER) - sizeof(struct ktext_chunk))
+
+/**
+ * struct ktext_intern - a text shared by identical nodes, see
+ * 			 ktext_set_intern()
+ *
+ * @hn:		the hlist_node object, in k->intern_hash
+ * @hash:	jhash() of @text, seeded with k->intern_seed
+ * @refs:	number of nodes pointing to @text, k->prot protected
+ * @len:	the length of @text
+ * @text:	the immutable payload, NUL terminated
+ */
+struct ktext_intern {
+	struct hlist_node hn;
+	u32 hash;
+	unsigned int refs;
+	size_t len;
+	char text[];
+};
+
+/**
+ * struct ktext_spill_hdr - header of a text in the spill file
+ *
+ * @len:	the length of the text following the header
+ * @prio:	the priority level of the text
+ * @flags:	KTEXT_SPILL_* flags
+ * @expires:	expiration time in jiffies, if KTEXT_SPILL_TTL
+ * @queued:	time the text was pushed, in jiffies
+ */
+struct ktext_spill_hdr {
+	u32 len;
+	u16 prio;
+	u16 flags;
+	u64 expires;
+	u64 queued;
+};
+
+#define KTEXT_SPILL_TTL 0x1
+
 /**
  * struct ktext_object -	the ktree FIFO object implemented with
  * 				Kernel lists.
  *
  * @n_elem:		number of elements in the FIFO
- * @head:		the list_head object
+ * @n_bytes:		total length of the texts in the FIFO
+ * @n_slots:		number of elements in the FIFO plus the slots
+ * 			reserved by writers, see ktext_reserve()
+ * @head:		one list_head object per priority level
+ * @prio_map:		bitmap of the non-empty priority levels
+ * @ttl_wheel:		timer wheel buckets of the texts with a time-to-live
+ * @ttl_clock:		next timer wheel slot to be swept
+ * @ttl_work:		the periodic timer wheel sweep
+ * @n_ttl:		number of texts with a time-to-live
+ * @n_expired:		number of texts reclaimed because expired
+ * @max_elements:	maximum number of elements, 0 for unlimited
+ * @full_policy:	what to do when @max_elements is reached
+ * @n_dropped:		number of texts dropped because of @full_policy
+ * @node:		NUMA node the FIFO and its texts are allocated on
+ * @enqueue_nh:		notifier chain called after each push
+ * @pending:		nodes pushed by ktext_push_atomic(), newest
+ * 			first, not yet moved to the FIFO
+ * @pool:		the per-CPU node pools of ktext_push_atomic()
+ * @spill_threshold:	number of texts kept in memory before
+ * 			spilling, 0 for never
+ * @n_spill:		number of texts in @spill, accounted in @n_elem
+ * @spill:		the shmem spill file, NULL if not spilling
+ * @spill_buf:		KTEXT_SPILL_CHUNK bytes read back buffer
+ * @spill_rpos:		@spill offset of the oldest spilled text
+ * @spill_wpos:		@spill offset past the newest spilled text
+ * @spill_punched:	@spill offset up to which the pages read back
+ * 			have been freed
+ * @arena:		the arena chunk being filled, NULL if none
+ * @chunk_pool:		reserve of arena chunks, NULL if none
+ * @node_pool:		reserve of nodes, without KTEXT_ARENA, NULL if none
+ * @text_pool:		reserve of texts, one per size class (see
+ * 			ktext_text_class()), without KTEXT_ARENA,
+ * 			NULL if none
+ * @wm_high_ctx:	eventfd signaled when reaching @wm_high, or NULL
+ * @wm_low_ctx:		eventfd signaled when dropping to @wm_low, or NULL
+ * @wm_high:		high watermark, 0 if disabled
+ * @wm_low:		low watermark
+ * @wm_bytes:		watermarks are in bytes, instead of texts
+ * @wm_above:		@wm_high has been reached, @wm_low not yet
+ * @coalesce_size:	size of the coalesced records, 0 if not coalescing
+ * @coalesce_delay:	maximum time a text waits in @batch, in jiffies
+ * @coalesce_work:	flushes @batch after @coalesce_delay
+ * @batch:		per priority level record being filled, not
+ * 			queued yet, NULL if none
+ * @inflight:		leased records not acked yet, by sequence number
+ * @n_inflight:		number of records in @inflight, holding their
+ * 			FIFO slot
+ * @lease_seq:		sequence number of the last leased record
+ * @lease_work:		the periodic requeueing of expired leases
+ * @comp_tfm:		the KTEXT_COMPRESS_ALG transform, NULL if not
+ * 			compressing
+ * @comp_threshold:	minimum length of the texts to be compressed
+ * @comp_buf:		KTEXT_RECORD_SIZE bytes scratch buffer of
+ * 			@comp_tfm
+ * @comp_st:		the compression counters
+ * @intern_max:		maximum length of the interned texts
+ * @intern_hash:	2^KTEXT_INTERN_HASH_BITS buckets of struct
+ * 			ktext_intern, NULL if not interning
+ * @intern_seed:	random jhash() seed of @intern_hash
  * @ktext_rwsem:	the readers/writers semaphore
  * @prot:		the semaphore protecting against concurrent
  * 			access to the object
  */
 struct ktext_object {
 	size_t n_elem;
-	struct list_head head;
+	size_t n_bytes;
+	atomic_t n_slots;
+	struct list_head head[KTEXT_PRIO_LEVELS];
+	DECLARE_BITMAP(prio_map, KTEXT_PRIO_LEVELS);
+	struct list_head ttl_wheel[KTEXT_TTL_BUCKETS];
+	unsigned long ttl_clock;
+	struct delayed_work ttl_work;
+	size_t n_ttl;
+	u64 n_expired;
+	int max_elements;
+	int full_policy;
+	u64 n_dropped;
+	int node;
+	struct atomic_notifier_head enqueue_nh;
+	struct llist_head pending;
+	struct ktext_pool __percpu *pool;
+	int spill_threshold;
+	size_t n_spill;
+	struct file *spill;
+	char *spill_buf;
+	loff_t spill_rpos;
+	loff_t spill_wpos;
+	loff_t spill_punched;
+	struct ktext_chunk *arena;
+	mempool_t *chunk_pool;
+	mempool_t *node_pool;
+	mempool_t *text_pool[KTEXT_RESERVE_CLASSES];
+	struct eventfd_ctx *wm_high_ctx;
+	struct eventfd_ctx *wm_low_ctx;
+	u64 wm_high;
+	u64 wm_low;
+	bool wm_bytes;
+	bool wm_above;
+	size_t coalesce_size;
+	unsigned long coalesce_delay;
+	struct delayed_work coalesce_work;
+	struct ktext_object_node *batch[KTEXT_PRIO_LEVELS];
+	struct list_head inflight;
+	size_t n_inflight;
+	u64 lease_seq;
+	struct delayed_work lease_work;
+	struct crypto_comp *comp_tfm;
+	size_t comp_threshold;
+	char *comp_buf;
+	struct ktext_comp_stats comp_st;
+	size_t intern_max;
+	struct hlist_head *intern_hash;
+	u32 intern_seed;
 #ifdef KTEXT_ALT_RW_STARV_PROT
 	int __nbr;
 	int __nbw;
@@ -72,28 +315,362 @@ struct ktext_object {
 /**
  * struct ktext_object_node -	Linux list_head node objectm
  *
- * @text:	the actual text (payload)
- * @kl:		the list_head object
+ * @text:	the actual text (payload), may contain NUL bytes
+ * @len:	the length of @text
+ * @raw_len:	the length of @text once decompressed, 0 if stored
+ * 		as it is, see ktext_node_len()
+ * @prio:	the priority level the node is queued on
+ * @expires:	expiration time in jiffies, valid if @tl is not empty
+ * @queued:	time the text was pushed, in jiffies
+ * @pooled:	the node is a ktext_pool_node_t, @text is inline
+ * @owner:	the quota of the writer, NULL if none
+ * @chunk:	the arena chunk holding the node and @text, NULL if
+ * 		they have been kmalloc()ed
+ * @shared:	the interned text @text points to, NULL if none
+ * @text_class:	the size class of @text, if taken from the reserve
+ * @seq:	the lease sequence number, while in flight
+ * @lease:	the lease deadline in jiffies, while in flight
+ * @expiring:	@expires is valid, while in flight
+ * @kl:		the list_head object, on a priority level or in flight
+ * @tl:		the timer wheel bucket list_head object
  */
 typedef struct ktext_object_node {
     char *text;
+    size_t len;
+    size_t raw_len;
+    unsigned int prio;
+    unsigned long expires;
+    unsigned long queued;
+    bool pooled;
+    ktext_quota_t *owner;
+    struct ktext_chunk *chunk;
+    struct ktext_intern *shared;
+    unsigned int text_class;
+    u64 seq;
+    unsigned long lease;
+    bool expiring;
     struct list_head kl;
+    struct list_head tl;
 } ktext_object_node_t;
 
+/**
+ * struct ktext_pool_node - node preallocated for ktext_push_atomic()
+ *
+ * @n:		the FIFO node, @n.text pointing to @text
+ * @ll:		the llist_node object, for the pool and pending lists
+ * @cpu:	the CPU whose pool the node belongs to
+ * @text:	the inline payload
+ */
+typedef struct ktext_pool_node {
+	ktext_object_node_t n;
+	struct llist_node ll;
+	int cpu;
+	char text[sizeof(u32) + KTEXT_ATOMIC_SIZE + 1];
+} ktext_pool_node_t;
+
+static void
+ktext_ttl_sweep(struct work_struct *work);
+
+static void
+ktext_coalesce_sweep(struct work_struct *work);
+
+static void
+ktext_lease_sweep(struct work_struct *work);
+
+/**
+ * ktext_chunk_put() - drop a reference on an arena chunk
+ *
+ * @k:		the ktext_object_t object
+ * @c:		the ktext_chunk object, may be NULL
+ *
+ * k->prot held, unless the chunk is not shared anymore.
+ *
+ */
+static void
+ktext_chunk_put(ktext_object_t *k, struct ktext_chunk *c)
+{
+	if (c == NULL || --c->refs > 0)
+		return;
+	if (k->chunk_pool)
+		mempool_free(virt_to_page(c), k->chunk_pool);
+	else
+		free_pages((unsigned long) c, KTEXT_ARENA_ORDER);
+}
+
+/**
+ * ktext_mempools_destroy() - free the memory reserves
+ *
+ * @k:		the ktext_object_t object
+ *
+ */
+static void
+ktext_mempools_destroy(ktext_object_t *k)
+{
+	int i;
+
+	if (k->chunk_pool)
+		mempool_destroy(k->chunk_pool);
+	if (k->node_pool)
+		mempool_destroy(k->node_pool);
+	for (i = 0; i < KTEXT_RESERVE_CLASSES; i++) {
+		if (k->text_pool[i])
+			mempool_destroy(k->text_pool[i]);
+		k->text_pool[i] = NULL;
+	}
+	k->chunk_pool = NULL;
+	k->node_pool = NULL;
+}
+
+#ifndef KTEXT_ARENA
+
+/* the reserve size classes, see KTEXT_RESERVE_CLASSES */
+static const size_t ktext_text_class_size[KTEXT_RESERVE_CLASSES] = {
+	128, 1024, KTEXT_RECORD_SIZE + 1,
+};
+
+/**
+ * ktext_text_class() - the reserve size class of a text
+ *
+ * @size:	the size of the text buffer, NUL byte included
+ *
+ */
+static unsigned int
+ktext_text_class(size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < KTEXT_RESERVE_CLASSES - 1; i++)
+		if (size <= ktext_text_class_size[i])
+			break;
+	return i;
+}
+
+#endif
+
+/**
+ * ktext_mempools_init() - create the memory reserves
+ *
+ * @k:		the ktext_object_t object
+ * @reserve:	number of KTEXT_SIZE texts the reserves shall hold,
+ * 		0 for none
+ *
+ * With KTEXT_ARENA, the reserve is made of arena chunks, plus one
+ * for the chunk being filled. Otherwise, of nodes and of @reserve
+ * texts of each size class, so that short texts don't tie up
+ * KTEXT_RECORD_SIZE buffers.
+ *
+ */
+static int
+ktext_mempools_init(ktext_object_t *k, unsigned int reserve)
+{
+#ifdef KTEXT_ARENA
+	unsigned int per_chunk;
+#else
+	int i;
+#endif
+
+	k->chunk_pool = NULL;
+	k->node_pool = NULL;
+	memset(k->text_pool, 0, sizeof(k->text_pool));
+	if (!reserve)
+		return 0;
+
+#ifdef KTEXT_ARENA
+	per_chunk = KTEXT_CHUNK_DATA_SIZE /
+		ALIGN(sizeof(ktext_object_node_t) + KTEXT_RECORD_SIZE + 1,
+				sizeof(long));
+	k->chunk_pool = mempool_create_page_pool(
+			DIV_ROUND_UP(reserve, per_chunk) + 1, KTEXT_ARENA_ORDER);
+	if (k->chunk_pool == NULL)
+		return -ENOMEM;
+#else
+	k->node_pool = mempool_create_kmalloc_pool(reserve,
+			sizeof(ktext_object_node_t));
+	if (k->node_pool == NULL)
+		goto ktext_mempools_init_nomem;
+	for (i = 0; i < KTEXT_RESERVE_CLASSES; i++) {
+		k->text_pool[i] = mempool_create_kmalloc_pool(reserve,
+				ktext_text_class_size[i]);
+		if (k->text_pool[i] == NULL)
+			goto ktext_mempools_init_nomem;
+	}
+#endif
+	return 0;
+
+#ifndef KTEXT_ARENA
+ktext_mempools_init_nomem:
+	ktext_mempools_destroy(k);
+	return -ENOMEM;
+#endif
+}
+
+/**
+ * ktext_pool_destroy() - free the per-CPU node pools
+ *
+ * @k:		the ktext_object_t object, with no pooled node
+ * 		left on the FIFO or on the pending list
+ *
+ */
+static void
+ktext_pool_destroy(ktext_object_t *k)
+{
+	struct ktext_pool *pool;
+	struct llist_node *ln, *next;
+	int cpu;
+
+	if (k->pool == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(k->pool, cpu);
+		for (ln = pool->free; ln != NULL; ln = next) {
+			next = ln->next;
+			kfree(llist_entry(ln, ktext_pool_node_t, ll));
+		}
+		pool->free = NULL;
+		ln = llist_del_all(&pool->returned);
+		for (; ln != NULL; ln = next) {
+			next = ln->next;
+			kfree(llist_entry(ln, ktext_pool_node_t, ll));
+		}
+	}
+	free_percpu(k->pool);
+	k->pool = NULL;
+}
+
+/**
+ * ktext_pool_init() - allocate and fill the per-CPU node pools
+ *
+ * @k:		the ktext_object_t object
+ * @nr:		number of nodes per CPU
+ *
+ * Nodes are allocated on the FIFO node, if any, on the node of
+ * the CPU owning them otherwise.
+ *
+ */
+static int
+ktext_pool_init(ktext_object_t *k, unsigned int nr)
+{
+	struct ktext_pool *pool;
+	ktext_pool_node_t *pn;
+	unsigned int i;
+	int cpu;
+
+	k->pool = alloc_percpu(struct ktext_pool);
+	if (k->pool == NULL)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(k->pool, cpu);
+		pool->free = NULL;
+		init_llist_head(&pool->returned);
+	}
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(k->pool, cpu);
+		for (i = 0; i < nr; i++) {
+			pn = kmalloc_node(sizeof(ktext_pool_node_t), GFP_KERNEL,
+					k->node != NUMA_NO_NODE ? k->node :
+					cpu_to_node(cpu));
+			if (pn == NULL)
+				goto ktext_pool_init_nomem;
+			pn->n.text = pn->text;
+			pn->n.pooled = true;
+			pn->n.chunk = NULL;
+			pn->cpu = cpu;
+			pn->ll.next = pool->free;
+			pool->free = &pn->ll;
+		}
+	}
+	return 0;
+
+ktext_pool_init_nomem:
+	ktext_pool_destroy(k);
+	return -ENOMEM;
+}
+
+/**
+ * ktext_pool_put() - give a node back to its per-CPU pool
+ *
+ * @k:		the ktext_object_t object
+ * @pn:		the ktext_pool_node_t object
+ *
+ */
+static void
+ktext_pool_put(ktext_object_t *k, ktext_pool_node_t *pn)
+{
+	llist_add(&pn->ll, &per_cpu_ptr(k->pool, pn->cpu)->returned);
+}
+
 int __must_check
-ktext_object_init(ktext_object_t **k)
+ktext_object_init(ktext_object_t **k, int node, unsigned int reserve)
 {
+	int i;
+	int status;
+
 	if (k == NULL)
 		BUG();
 	if (*k != NULL) {
 		BUG_ON(k);
 		BUG();
 	}
-	*k = kmalloc(sizeof(ktext_object_t), GFP_KERNEL);
+#ifdef KTEXT_ARENA
+	/* a chunk must fit the largest record */
+	BUILD_BUG_ON(ALIGN(sizeof(ktext_object_node_t) + KTEXT_RECORD_SIZE + 1,
+				sizeof(long)) > KTEXT_CHUNK_DATA_SIZE);
+#endif
+	*k = kmalloc_node(sizeof(ktext_object_t), GFP_KERNEL, node);
 	if (*k == NULL)
 		return -ENOMEM;
 
+	(*k)->node = node;
+	status = ktext_mempools_init(*k, reserve);
+	if (status) {
+		kfree(*k);
+		*k = NULL;
+		return status;
+	}
+	/* see ktext_set_atomic_pool() */
+	(*k)->pool = NULL;
+	ATOMIC_INIT_NOTIFIER_HEAD(&(*k)->enqueue_nh);
+	init_llist_head(&(*k)->pending);
+	(*k)->spill_threshold = 0;
+	(*k)->n_spill = 0;
+	(*k)->spill = NULL;
+	(*k)->spill_buf = NULL;
+	(*k)->spill_rpos = 0;
+	(*k)->spill_wpos = 0;
+	(*k)->spill_punched = 0;
+	(*k)->arena = NULL;
+	(*k)->wm_high_ctx = NULL;
+	(*k)->wm_low_ctx = NULL;
+	(*k)->wm_high = 0;
+	(*k)->wm_low = 0;
+	(*k)->wm_bytes = false;
+	(*k)->wm_above = false;
+	(*k)->coalesce_size = 0;
+	(*k)->coalesce_delay = 0;
+	INIT_DELAYED_WORK(&(*k)->coalesce_work, ktext_coalesce_sweep);
+	INIT_LIST_HEAD(&(*k)->inflight);
+	(*k)->n_inflight = 0;
+	(*k)->lease_seq = 0;
+	INIT_DELAYED_WORK(&(*k)->lease_work, ktext_lease_sweep);
+	(*k)->comp_tfm = NULL;
+	(*k)->comp_threshold = 0;
+	(*k)->comp_buf = NULL;
+	memset(&(*k)->comp_st, 0, sizeof((*k)->comp_st));
+	(*k)->intern_max = 0;
+	(*k)->intern_hash = NULL;
+	(*k)->intern_seed = 0;
 	(*k)->n_elem = 0;
+	(*k)->n_bytes = 0;
+	atomic_set(&(*k)->n_slots, 0);
+	(*k)->n_ttl = 0;
+	(*k)->n_expired = 0;
+	(*k)->max_elements = 0;
+	(*k)->full_policy = KTEXT_FULL_REJECT;
+	(*k)->n_dropped = 0;
+	(*k)->ttl_clock = jiffies >> KTEXT_TTL_BUCKET_SHIFT;
+	INIT_DELAYED_WORK(&(*k)->ttl_work, ktext_ttl_sweep);
 #ifdef KTEXT_ALT_RW_STARV_PROT
 	(*k)->__nbr = 0;
 	(*k)->__nbw = 0;
@@ -106,172 +683,2197 @@ ktext_object_init(ktext_object_t **k)
 	init_rwsem(&(*k)->__ktext_rwsem);
 #endif
 	mutex_init(&(*k)->prot);
-	INIT_LIST_HEAD(&(*k)->head);
+	for (i = 0; i < KTEXT_PRIO_LEVELS; i++) {
+		INIT_LIST_HEAD(&(*k)->head[i]);
+		(*k)->batch[i] = NULL;
+	}
+	bitmap_zero((*k)->prio_map, KTEXT_PRIO_LEVELS);
+	for (i = 0; i < KTEXT_TTL_BUCKETS; i++)
+		INIT_LIST_HEAD(&(*k)->ttl_wheel[i]);
 	return 0;
 }
 
 
-void
-ktext_object_destroy(ktext_object_t **k)
-{
-	if (k == NULL)
-		BUG();
-	if (*k == NULL) {
-		BUG_ON(*k);
-		BUG();
+void
+ktext_object_destroy(ktext_object_t **k)
+{
+	if (k == NULL)
+		BUG();
+	if (*k == NULL) {
+		BUG_ON(*k);
+		BUG();
+	}
+
+	cancel_delayed_work_sync(&(*k)->coalesce_work);
+	cancel_delayed_work_sync(&(*k)->lease_work);
+	cancel_delayed_work_sync(&(*k)->ttl_work);
+	ktext_empty(*k);
+	ktext_pool_destroy(*k);
+	ktext_chunk_put(*k, (*k)->arena);
+	ktext_mempools_destroy(*k);
+	ktext_set_watermarks(*k, NULL, NULL, 0, 0, false);
+	if ((*k)->comp_tfm)
+		crypto_free_comp((*k)->comp_tfm);
+	kfree((*k)->comp_buf);
+	/* no node left, no interned text either */
+	kfree((*k)->intern_hash);
+	kfree(*k);
+}
+
+/**
+ * ktext_node_alloc() - allocate a node along with room for its text
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @count:	the length of the text
+ *
+ * With KTEXT_ARENA, the node and the text are bump-allocated,
+ * back to back, in the current arena chunk, switching to a fresh
+ * one once full. Otherwise, they are kmalloc()ed.
+ * n->text points to count + 1 bytes, the rest is to be filled by
+ * ktext_object_node_init().
+ *
+ */
+static ktext_object_node_t *
+ktext_node_alloc(ktext_object_t *k, size_t count)
+{
+	ktext_object_node_t *n;
+#ifdef KTEXT_ARENA
+	struct ktext_chunk *c;
+	struct page *page;
+	size_t size;
+
+	size = ALIGN(sizeof(ktext_object_node_t) + count + 1, sizeof(long));
+	if (size > KTEXT_CHUNK_DATA_SIZE)
+		return NULL;
+
+	c = k->arena;
+	if (c == NULL || c->used + size > KTEXT_CHUNK_DATA_SIZE) {
+		if (k->chunk_pool)
+			/* no reclaim, and no waiting on the reserve
+			 * under k->prot, only readers refill it */
+			page = mempool_alloc(k->chunk_pool, GFP_NOWAIT);
+		else
+			page = alloc_pages_node(k->node, GFP_KERNEL, KTEXT_ARENA_ORDER);
+		if (page == NULL)
+			return NULL;
+		c = (struct ktext_chunk *) page_address(page);
+		c->refs = 1;
+		c->used = 0;
+		/* the old one is freed as soon as its texts are gone */
+		ktext_chunk_put(k, k->arena);
+		k->arena = c;
+	}
+
+	n = (ktext_object_node_t *) (c->data + c->used);
+	c->used += size;
+	c->refs++;
+	n->text = (char *) (n + 1);
+	n->chunk = c;
+#else
+	if (k->node_pool) {
+		/* same as above */
+		n = mempool_alloc(k->node_pool, GFP_NOWAIT);
+		if (n == NULL)
+			return NULL;
+		n->text_class = ktext_text_class(count + 1);
+		n->text = mempool_alloc(k->text_pool[n->text_class], GFP_NOWAIT);
+		if (n->text == NULL) {
+			mempool_free(n, k->node_pool);
+			return NULL;
+		}
+		n->chunk = NULL;
+		return n;
+	}
+
+	n = kmalloc_node(sizeof(ktext_object_node_t), GFP_KERNEL, k->node);
+	if (n == NULL)
+		return NULL;
+	/* + 1: keep it NULL terminated, for whoever wants to
+	 * print it, the length is what counts though */
+	n->text = (char *) kmalloc_node((sizeof(char) * (count + 1)),
+			GFP_KERNEL, k->node);
+	if (n->text == NULL) {
+		kfree(n);
+		return NULL;
+	}
+	n->chunk = NULL;
+#endif
+	return n;
+}
+
+/**
+ * ktext_object_node_init() -  initialize a previously allocated
+ *                             ktext_object_node_t
+ *
+ * @n:         the ktext_object_node_t object
+ * @text:      the text to attach to this ktext_object_node_t
+ * @len:       the length of @text
+ * @prio:      the priority level of @text
+ * @ttl:       time-to-live of @text in jiffies, 0 for none
+ *
+ */
+static void
+ktext_object_node_init(ktext_object_node_t *n, char *text, size_t len,
+		unsigned int prio, unsigned long ttl) {
+	n->text = text;
+	n->len = len;
+	n->raw_len = 0;
+	n->prio = prio;
+	n->queued = jiffies;
+	n->expires = n->queued + ttl;
+	n->pooled = false;
+	n->owner = NULL;
+	n->shared = NULL;
+	INIT_LIST_HEAD(&n->tl);
+}
+
+/**
+ * ktext_intern_put() - drop a reference on an interned text
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @s:		the struct ktext_intern object
+ *
+ */
+static void
+ktext_intern_put(ktext_object_t *k, struct ktext_intern *s)
+{
+	if (--s->refs > 0)
+		return;
+	hlist_del(&s->hn);
+	kfree(s);
+}
+
+/**
+ * ktext_intern_node() - allocate a node pointing to the interned
+ * 			 copy of a text
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @text:	the text
+ * @count:	the length of @text
+ * @prio:	the priority level of @text
+ * @ttl:	time-to-live of @text in jiffies, 0 for none
+ *
+ * The interned copy is looked up by content, and created if
+ * missing. Only the node is allocated on a hit.
+ * A bucket holding KTEXT_INTERN_CHAIN_MAX other texts already is
+ * not walked any further: NULL is returned, the text shall then
+ * be pushed on its own. Returns ERR_PTR(-ENOMEM) if out of memory.
+ *
+ */
+static ktext_object_node_t *
+ktext_intern_node(ktext_object_t *k, const char *text, size_t count,
+		unsigned int prio, unsigned long ttl)
+{
+	ktext_object_node_t *n;
+	struct ktext_intern *s;
+	struct hlist_head *bucket;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+	struct hlist_node *pos;
+#endif
+	unsigned int chain;
+	u32 hash;
+
+	hash = jhash(text, count, k->intern_seed);
+	bucket = &k->intern_hash[hash_32(hash, KTEXT_INTERN_HASH_BITS)];
+	chain = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0)
+	hlist_for_each_entry(s, bucket, hn) {
+#else
+	hlist_for_each_entry(s, pos, bucket, hn) {
+#endif
+		if (s->hash == hash && s->len == count &&
+				memcmp(s->text, text, count) == 0) {
+			s->refs++;
+			goto ktext_intern_node_found;
+		}
+		if (++chain >= KTEXT_INTERN_CHAIN_MAX)
+			/* crowded bucket, don't make it worse */
+			return NULL;
+	}
+
+	s = kmalloc_node(sizeof(struct ktext_intern) + count + 1, GFP_KERNEL,
+			k->node);
+	if (s == NULL)
+		return ERR_PTR(-ENOMEM);
+	s->hash = hash;
+	s->refs = 1;
+	s->len = count;
+	memcpy(s->text, text, count);
+	s->text[count] = '\0';
+	hlist_add_head(&s->hn, bucket);
+
+ktext_intern_node_found:
+	n = kmalloc_node(sizeof(ktext_object_node_t), GFP_KERNEL, k->node);
+	if (n == NULL) {
+		ktext_intern_put(k, s);
+		return ERR_PTR(-ENOMEM);
+	}
+	ktext_object_node_init(n, s->text, count, prio, ttl);
+	n->chunk = NULL;
+	n->shared = s;
+	return n;
+}
+
+/**
+ * ktext_object_node_destroy() -       deinitialize a previously
+ *                                     initialized ktext_object_node_t
+ *
+ * @k: the ktext_object_t object
+ * @n: the ktext_object_node_t object
+ *
+ * Pooled nodes go back to their pool, arena nodes release
+ * their chunk.
+ *
+ */
+static void
+ktext_object_node_destroy(ktext_object_t *k, ktext_object_node_t *n) {
+	if (n == NULL)
+		BUG();
+	if (n->shared) {
+		ktext_intern_put(k, n->shared);
+		kfree(n);
+		return;
+	}
+	if (n->pooled) {
+		ktext_pool_put(k, container_of(n, ktext_pool_node_t, n));
+		return;
+	}
+	if (n->chunk) {
+		ktext_chunk_put(k, n->chunk);
+		return;
+	}
+	if (k->node_pool) {
+		mempool_free(n->text, k->text_pool[n->text_class]);
+		mempool_free(n, k->node_pool);
+		return;
+	}
+	if (n->text)
+		kfree(n->text);
+    kfree(n);
+}
+
+/**
+ * ktext_node_len() - the length of the text of a node, as pushed
+ *
+ * @n:		the ktext_object_node_t object
+ *
+ */
+static inline size_t
+ktext_node_len(ktext_object_node_t *n)
+{
+	return n->raw_len ? n->raw_len : n->len;
+}
+
+/**
+ * ktext_compress() - compress a text, if worth it
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @text:	the text
+ * @count:	the length of @text
+ * @clen:	where to store the compressed length
+ *
+ * Returns k->comp_buf, holding the compressed text, or NULL if
+ * not compressing, @text is too short or doesn't shrink.
+ *
+ */
+static char *
+ktext_compress(ktext_object_t *k, const char *text, size_t count,
+		size_t *clen)
+{
+	unsigned int dlen;
+	s64 start;
+	int status;
+
+	if (k->comp_tfm == NULL || count < k->comp_threshold || count < 2)
+		return NULL;
+
+	/* at least one byte shall be saved */
+	dlen = min_t(size_t, count - 1, KTEXT_RECORD_SIZE);
+	start = ktime_to_ns(ktime_get());
+	status = crypto_comp_compress(k->comp_tfm, (const u8 *) text, count,
+			(u8 *) k->comp_buf, &dlen);
+	k->comp_st.compress_ns += ktime_to_ns(ktime_get()) - start;
+	if (status != 0)
+		return NULL;
+
+	k->comp_st.n_compressed++;
+	k->comp_st.bytes_in += count;
+	k->comp_st.bytes_out += dlen;
+	*clen = dlen;
+	return k->comp_buf;
+}
+
+/**
+ * ktext_decompress() - decompress the text of a node
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @n:		the ktext_object_node_t object, n->raw_len set
+ * @buf:	where to store the text, n->raw_len bytes at least
+ *
+ */
+static int
+ktext_decompress(ktext_object_t *k, ktext_object_node_t *n, char *buf)
+{
+	unsigned int dlen;
+	s64 start;
+	int status;
+
+	dlen = n->raw_len;
+	start = ktime_to_ns(ktime_get());
+	status = crypto_comp_decompress(k->comp_tfm, (const u8 *) n->text,
+			n->len, (u8 *) buf, &dlen);
+	k->comp_st.decompress_ns += ktime_to_ns(ktime_get()) - start;
+	if (status == 0 && dlen != n->raw_len)
+		status = -EIO;
+	if (status != 0)
+		printk(KERN_NOTICE "ktext: cannot decompress a text (%d)\n",
+				status);
+	return status;
+}
+
+/**
+ * ktext_node_compress() - replace a node with a compressed copy
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @n:		the ktext_object_node_t object, not queued
+ *
+ * Returns the node to be queued: the copy, @n being destroyed,
+ * or @n itself if not worth compressing or out of memory.
+ *
+ */
+static ktext_object_node_t *
+ktext_node_compress(ktext_object_t *k, ktext_object_node_t *n)
+{
+	ktext_object_node_t *c;
+	char *ctext;
+	size_t clen;
+
+	ctext = ktext_compress(k, n->text, n->len, &clen);
+	if (ctext == NULL)
+		return n;
+	c = ktext_node_alloc(k, clen);
+	if (c == NULL)
+		return n;
+
+	memcpy(c->text, ctext, clen);
+	c->text[clen] = '\0';
+	ktext_object_node_init(c, c->text, clen, n->prio, 0);
+	c->raw_len = n->len;
+	c->queued = n->queued;
+	c->expires = n->expires;
+	c->owner = n->owner;
+	n->owner = NULL;
+	ktext_object_node_destroy(k, n);
+	return c;
+}
+
+static void
+ktext_eventfd_signal(struct eventfd_ctx *ctx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
+/**
+ * ktext_watermark_check() - signal the watermark crossings
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ *
+ * Called after every change of the FIFO level. Edge triggered,
+ * with hysteresis: crossing @wm_high again requires dropping to
+ * @wm_low first.
+ *
+ */
+static void
+ktext_watermark_check(ktext_object_t *k)
+{
+	u64 level;
+
+	if (!k->wm_high)
+		return;
+
+	level = k->wm_bytes ? k->n_bytes : k->n_elem;
+	if (!k->wm_above && level >= k->wm_high) {
+		k->wm_above = true;
+		if (k->wm_high_ctx)
+			ktext_eventfd_signal(k->wm_high_ctx);
+	} else if (k->wm_above && level <= k->wm_low) {
+		k->wm_above = false;
+		if (k->wm_low_ctx)
+			ktext_eventfd_signal(k->wm_low_ctx);
+	}
+}
+
+/**
+ * ktext_node_link() -	queue a node on its priority level, and on
+ * 			the timer wheel if it has a time-to-live.
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @n:		the ktext_object_node_t object
+ * @ttl:	time-to-live of @n in jiffies, 0 for none
+ * @reserved:	a slot for @n has been taken by ktext_reserve()
+ *
+ */
+static void
+ktext_node_link(ktext_object_t *k, ktext_object_node_t *n, unsigned long ttl,
+		bool reserved)
+{
+	list_add_tail(&n->kl, &k->head[n->prio]);
+	__set_bit(n->prio, k->prio_map);
+	k->n_elem++;
+	k->n_bytes += ktext_node_len(n);
+	if (!reserved)
+		atomic_inc(&k->n_slots);
+	ktext_watermark_check(k);
+
+	if (!ttl)
+		return;
+	if (k->n_ttl++ == 0) {
+		/* the wheel is empty, no need to catch up */
+		k->ttl_clock = jiffies >> KTEXT_TTL_BUCKET_SHIFT;
+		schedule_delayed_work(&k->ttl_work, 1UL << KTEXT_TTL_BUCKET_SHIFT);
+	}
+	list_add_tail(&n->tl, &k->ttl_wheel[
+			(n->expires >> KTEXT_TTL_BUCKET_SHIFT) & (KTEXT_TTL_BUCKETS - 1)]);
+}
+
+/**
+ * ktext_node_unlink() - remove a node from the FIFO
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @n:		the ktext_object_node_t object
+ *
+ */
+static void
+ktext_node_unlink(ktext_object_t *k, ktext_object_node_t *n)
+{
+	list_del(&n->kl);
+	if (list_empty(&k->head[n->prio]))
+		__clear_bit(n->prio, k->prio_map);
+	k->n_elem--;
+	k->n_bytes -= ktext_node_len(n);
+	atomic_dec(&k->n_slots);
+	if (n->owner) {
+		ktext_quota_dequeued(n->owner);
+		n->owner = NULL;
+	}
+	ktext_watermark_check(k);
+
+	if (!list_empty(&n->tl)) {
+		list_del_init(&n->tl);
+		k->n_ttl--;
+	}
+}
+
+/**
+ * ktext_node_expired() - has the node time-to-live expired?
+ *
+ * @n:		the ktext_object_node_t object
+ *
+ */
+static inline bool
+ktext_node_expired(ktext_object_node_t *n)
+{
+	return !list_empty(&n->tl) && time_after_eq(jiffies, n->expires);
+}
+
+/**
+ * ktext_ttl_sweep() - timer wheel sweep, reclaim expired texts.
+ *
+ * @work:	the ttl_work member of ktext_object_t
+ *
+ * Walk the buckets whose slot has come since the last run (at most
+ * a full round), reclaiming what has expired. Texts living longer
+ * than a wheel round stay in their bucket until a later round.
+ * Reschedules itself as long as there are texts with a time-to-live.
+ *
+ */
+static void
+ktext_ttl_sweep(struct work_struct *work)
+{
+	ktext_object_t *k;
+	ktext_object_node_t *n, *q;
+	struct list_head *bucket;
+	unsigned long now_slot;
+	unsigned long slots;
+	unsigned long i;
+
+	k = container_of(work, ktext_object_t, ttl_work.work);
+
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	now_slot = jiffies >> KTEXT_TTL_BUCKET_SHIFT;
+	slots = now_slot - k->ttl_clock + 1;
+	if (slots > KTEXT_TTL_BUCKETS)
+		slots = KTEXT_TTL_BUCKETS;
+
+	for (i = 0; i < slots && k->n_ttl > 0; i++) {
+		bucket = &k->ttl_wheel[(now_slot - i) & (KTEXT_TTL_BUCKETS - 1)];
+		list_for_each_entry_safe(n, q, bucket, tl) {
+			if (!ktext_node_expired(n))
+				continue;
+			ktext_node_unlink(k, n);
+			ktext_object_node_destroy(k, n);
+			k->n_expired++;
+		}
+	}
+	k->ttl_clock = now_slot + 1;
+
+	if (k->n_ttl > 0)
+		schedule_delayed_work(&k->ttl_work, 1UL << KTEXT_TTL_BUCKET_SHIFT);
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+}
+
+/**
+ * ktext_node_lease() - move a node from the FIFO to the in-flight list
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @n:		the ktext_object_node_t object, queued
+ * @lease:	the lease duration in jiffies
+ *
+ * The node keeps its FIFO slot until acked, see ktext_ack(), or
+ * requeued. Returns the sequence number given to @n.
+ *
+ */
+static u64
+ktext_node_lease(ktext_object_t *k, ktext_object_node_t *n,
+		unsigned long lease)
+{
+	n->expiring = !list_empty(&n->tl);
+	ktext_node_unlink(k, n);
+	atomic_inc(&k->n_slots);
+
+	n->seq = ++k->lease_seq;
+	n->lease = jiffies + lease;
+	list_add_tail(&n->kl, &k->inflight);
+	if (k->n_inflight++ == 0)
+		schedule_delayed_work(&k->lease_work, KTEXT_LEASE_SWEEP);
+	return n->seq;
+}
+
+/**
+ * ktext_lease_requeue() - put a node whose lease expired back at
+ * 			   the head of its priority level
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @n:		the ktext_object_node_t object, off the in-flight list
+ *
+ * Returns 1 if requeued, 0 if its time-to-live expired meanwhile.
+ *
+ */
+static int
+ktext_lease_requeue(ktext_object_t *k, ktext_object_node_t *n)
+{
+	if (n->expiring && time_after_eq(jiffies, n->expires)) {
+		ktext_unreserve(k);
+		ktext_object_node_destroy(k, n);
+		k->n_expired++;
+		return 0;
+	}
+	ktext_node_link(k, n, n->expiring, true);
+	list_move(&n->kl, &k->head[n->prio]);
+	return 1;
+}
+
+/**
+ * ktext_lease_sweep() - requeue the records whose lease expired
+ *
+ * @work:	the lease_work member of ktext_object_t
+ *
+ * Expired records are requeued newest first, so that, among them,
+ * the oldest is read first again. Reschedules itself as long as
+ * records are in flight.
+ *
+ */
+static void
+ktext_lease_sweep(struct work_struct *work)
+{
+	ktext_object_t *k;
+	ktext_object_node_t *n, *q;
+	unsigned int prio;
+	LIST_HEAD(expired);
+	DECLARE_BITMAP(requeued, KTEXT_PRIO_LEVELS);
+
+	k = container_of(work, ktext_object_t, lease_work.work);
+	bitmap_zero(requeued, KTEXT_PRIO_LEVELS);
+
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	list_for_each_entry_safe(n, q, &k->inflight, kl) {
+		if (time_before(jiffies, n->lease))
+			continue;
+		list_move_tail(&n->kl, &expired);
+		k->n_inflight--;
+	}
+	list_for_each_entry_safe_reverse(n, q, &expired, kl) {
+		list_del(&n->kl);
+		prio = n->prio;
+		if (ktext_lease_requeue(k, n))
+			__set_bit(prio, requeued);
+	}
+
+	if (k->n_inflight > 0)
+		schedule_delayed_work(&k->lease_work, KTEXT_LEASE_SWEEP);
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+
+	for_each_set_bit(prio, requeued, KTEXT_PRIO_LEVELS)
+		atomic_notifier_call_chain(&k->enqueue_nh, prio, k);
+}
+
+void
+ktext_set_limit(ktext_object_t *k, int max_elements, int full_policy)
+{
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	WRITE_ONCE(k->max_elements, max_elements);
+	WRITE_ONCE(k->full_policy, full_policy);
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+}
+
+void
+ktext_set_watermarks(ktext_object_t *k, struct eventfd_ctx *high_ctx,
+		struct eventfd_ctx *low_ctx, u64 high, u64 low, bool bytes)
+{
+	struct eventfd_ctx *old_high_ctx;
+	struct eventfd_ctx *old_low_ctx;
+
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	old_high_ctx = k->wm_high_ctx;
+	old_low_ctx = k->wm_low_ctx;
+	k->wm_high_ctx = high_ctx;
+	k->wm_low_ctx = low_ctx;
+	k->wm_high = high;
+	k->wm_low = low;
+	k->wm_bytes = bytes;
+	k->wm_above = false;
+	/* already above? tell right away */
+	ktext_watermark_check(k);
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+
+	if (old_high_ctx)
+		eventfd_ctx_put(old_high_ctx);
+	if (old_low_ctx)
+		eventfd_ctx_put(old_low_ctx);
+}
+
+void
+ktext_set_coalesce(ktext_object_t *k, size_t size, unsigned long delay)
+{
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	k->coalesce_delay = delay;
+	WRITE_ONCE(k->coalesce_size, size);
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+}
+
+int __must_check
+ktext_set_atomic_pool(ktext_object_t *k, unsigned int nr)
+{
+	if (!nr)
+		return 0;
+	return ktext_pool_init(k, nr);
+}
+
+int __must_check
+ktext_set_intern(ktext_object_t *k, size_t max_len)
+{
+	struct hlist_head *buckets;
+	int i;
+
+	if (!max_len)
+		return 0;
+
+	buckets = kmalloc_node(sizeof(struct hlist_head) << KTEXT_INTERN_HASH_BITS,
+			GFP_KERNEL, k->node);
+	if (buckets == NULL)
+		return -ENOMEM;
+	for (i = 0; i < (1 << KTEXT_INTERN_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&buckets[i]);
+
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	k->intern_hash = buckets;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+	k->intern_seed = get_random_u32();
+#else
+	k->intern_seed = get_random_int();
+#endif
+	k->intern_max = max_len;
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	return 0;
+}
+
+int __must_check
+ktext_set_compress(ktext_object_t *k, size_t threshold)
+{
+	struct crypto_comp *tfm;
+	char *buf;
+
+	if (!threshold)
+		return 0;
+
+	tfm = crypto_alloc_comp(KTEXT_COMPRESS_ALG, 0, 0);
+	if (IS_ERR(tfm)) {
+		printk(KERN_NOTICE "ktext: " KTEXT_COMPRESS_ALG
+				" compression not available (%ld)\n", PTR_ERR(tfm));
+		return -ENOENT;
+	}
+	buf = kmalloc_node(KTEXT_RECORD_SIZE, GFP_KERNEL, k->node);
+	if (buf == NULL) {
+		crypto_free_comp(tfm);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	k->comp_tfm = tfm;
+	k->comp_buf = buf;
+	k->comp_threshold = threshold;
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	return 0;
+}
+
+int __must_check
+ktext_get_comp_stats(ktext_object_t *k, struct ktext_comp_stats *st)
+{
+	int status;
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0)
+		return status;
+	/* CRIT:ON */
+	*st = k->comp_st;
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	return 0;
+}
+
+void
+ktext_set_spill(ktext_object_t *k, int threshold)
+{
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	k->spill_threshold = threshold;
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+}
+
+int __must_check
+ktext_reserve(ktext_object_t *k)
+{
+	int max_elements;
+	int slots;
+
+	/* claim first, give back if over the limit: a single
+	 * atomic op on the fast path, and concurrent claimers
+	 * can never exceed max_elements all together */
+	slots = atomic_inc_return(&k->n_slots);
+	max_elements = READ_ONCE(k->max_elements);
+	if (max_elements == 0 || slots <= max_elements ||
+			READ_ONCE(k->full_policy) != KTEXT_FULL_REJECT)
+		return 1;
+
+	atomic_dec(&k->n_slots);
+	return 0;
+}
+
+void
+ktext_unreserve(ktext_object_t *k)
+{
+	atomic_dec(&k->n_slots);
+}
+
+/**
+ * ktext_make_room() -	enforce max_elements according to the
+ * 			full_policy, before queueing a new text.
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @prio:	the priority level of the new text
+ *
+ * With KTEXT_FULL_DROP_OLDEST, the oldest text of the least urgent
+ * level is evicted, unless the new text is even less urgent.
+ * Returns 1 if the new text can be queued, 0 if it must be dropped.
+ *
+ */
+static int
+ktext_make_room(ktext_object_t *k, unsigned int prio)
+{
+	ktext_object_node_t *n;
+	unsigned int last;
+
+	if (k->full_policy == KTEXT_FULL_REJECT || k->max_elements == 0)
+		return 1;
+
+	while (k->n_elem >= k->max_elements) {
+		last = find_last_bit(k->prio_map, KTEXT_PRIO_LEVELS);
+		if (k->full_policy == KTEXT_FULL_DROP_NEWEST ||
+				last >= KTEXT_PRIO_LEVELS || last < prio) {
+			k->n_dropped++;
+			return 0;
+		}
+		n = list_first_entry(&k->head[last], ktext_object_node_t, kl);
+		ktext_node_unlink(k, n);
+		ktext_object_node_destroy(k, n);
+		k->n_dropped++;
+	}
+	return 1;
+}
+
+static ssize_t
+ktext_spill_write(ktext_object_t *k, const void *buf, size_t count, loff_t pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+	return kernel_write(k->spill, buf, count, &pos);
+#else
+	return kernel_write(k->spill, buf, count, pos);
+#endif
+}
+
+static ssize_t
+ktext_spill_read(ktext_object_t *k, void *buf, size_t count, loff_t pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,14,0)
+	return kernel_read(k->spill, buf, count, &pos);
+#else
+	return kernel_read(k->spill, pos, buf, count);
+#endif
+}
+
+/**
+ * ktext_spill_open() - create the spill file, lazily
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ *
+ */
+static int
+ktext_spill_open(ktext_object_t *k)
+{
+	struct file *f;
+
+	k->spill_buf = vmalloc(KTEXT_SPILL_CHUNK);
+	if (k->spill_buf == NULL)
+		return -ENOMEM;
+
+	f = shmem_file_setup("ktext-spill", MAX_LFS_FILESIZE, VM_NORESERVE);
+	if (IS_ERR(f)) {
+		vfree(k->spill_buf);
+		k->spill_buf = NULL;
+		return PTR_ERR(f);
+	}
+	k->spill = f;
+	k->spill_rpos = 0;
+	k->spill_wpos = 0;
+	k->spill_punched = 0;
+#ifdef KTEXT_DEBUG
+	printk(KERN_NOTICE "ktext_spill_open: spilling, elems: %zd\n", k->n_elem);
+#endif
+	return 0;
+}
+
+/**
+ * ktext_spill_release() - drop the spill file and what is left in it
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ *
+ * Called once the spill file has been read back entirely, so that
+ * its pages are freed, or by ktext_empty().
+ *
+ */
+static void
+ktext_spill_release(ktext_object_t *k)
+{
+	if (k->spill == NULL)
+		return;
+
+	k->n_elem -= k->n_spill;
+	k->n_bytes -= k->spill_wpos - k->spill_rpos -
+		k->n_spill * sizeof(struct ktext_spill_hdr);
+	atomic_sub(k->n_spill, &k->n_slots);
+	k->n_spill = 0;
+	ktext_watermark_check(k);
+	fput(k->spill);
+	k->spill = NULL;
+	vfree(k->spill_buf);
+	k->spill_buf = NULL;
+	k->spill_rpos = 0;
+	k->spill_wpos = 0;
+	k->spill_punched = 0;
+}
+
+/**
+ * ktext_spill_punch() - free the spill file pages already read back
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ *
+ * Under sustained load the spill file may never be drained, hence
+ * never released: whole pages behind spill_rpos are punched out
+ * instead, so that the file only holds what is still spilled.
+ *
+ */
+static void
+ktext_spill_punch(ktext_object_t *k)
+{
+	loff_t end;
+	int status;
+
+	end = round_down(k->spill_rpos, PAGE_SIZE);
+	if (end - k->spill_punched < KTEXT_SPILL_CHUNK)
+		/* not worth a call yet */
+		return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,19,0)
+	status = vfs_fallocate(k->spill, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			k->spill_punched, end - k->spill_punched);
+#else
+	status = k->spill->f_op->fallocate ?
+		k->spill->f_op->fallocate(k->spill,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				k->spill_punched, end - k->spill_punched) :
+		-EOPNOTSUPP;
+#endif
+	if (status != 0) {
+#ifdef KTEXT_DEBUG
+		printk(KERN_NOTICE "ktext_spill_punch: cannot punch: %d\n",
+				status);
+#endif
+		return;
+	}
+	k->spill_punched = end;
+}
+
+/**
+ * ktext_spill_wanted() - shall the text being pushed be spilled?
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ *
+ * Once spilling, keep spilling until everything has been read
+ * back, in order not to overtake the spilled texts.
+ *
+ */
+static inline bool
+ktext_spill_wanted(ktext_object_t *k)
+{
+	return k->spill_threshold > 0 && (k->n_spill > 0 ||
+			k->n_elem >= (size_t) k->spill_threshold);
+}
+
+/**
+ * ktext_spill_push() - append a text to the spill file
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @text:	the text
+ * @count:	the length of @text
+ * @prio:	the priority level of @text
+ * @ttl:	time-to-live of @text in jiffies, 0 for none
+ * @reserved:	a slot for @text has been taken by ktext_reserve()
+ *
+ */
+static int
+ktext_spill_push(ktext_object_t *k, const char *text, size_t count,
+		unsigned int prio, unsigned long ttl, bool reserved)
+{
+	struct ktext_spill_hdr hdr;
+	ssize_t written;
+	int status;
+
+	if (k->spill == NULL) {
+		status = ktext_spill_open(k);
+		if (status)
+			return status;
+	}
+
+	hdr.len = count;
+	hdr.prio = prio;
+	hdr.flags = ttl ? KTEXT_SPILL_TTL : 0;
+	hdr.queued = jiffies;
+	hdr.expires = hdr.queued + ttl;
+
+	/* the write offset moves only once the whole text is there */
+	written = ktext_spill_write(k, &hdr, sizeof(hdr), k->spill_wpos);
+	if (written != sizeof(hdr))
+		return written < 0 ? written : -ENOSPC;
+	written = ktext_spill_write(k, text, count, k->spill_wpos + sizeof(hdr));
+	if (written != count)
+		return written < 0 ? written : -ENOSPC;
+	k->spill_wpos += sizeof(hdr) + count;
+
+	k->n_spill++;
+	k->n_elem++;
+	k->n_bytes += count;
+	if (!reserved)
+		atomic_inc(&k->n_slots);
+	ktext_watermark_check(k);
+	return 0;
+}
+
+/**
+ * ktext_spill_refill() - read spilled texts back to memory
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ *
+ * Read KTEXT_SPILL_CHUNK bytes at a time, until spill_threshold
+ * texts are in memory again. Once everything has been read back,
+ * the spill file is released.
+ *
+ */
+static void
+ktext_spill_refill(ktext_object_t *k)
+{
+	struct ktext_spill_hdr hdr;
+	ktext_object_node_t *n;
+	unsigned long ttl;
+	ssize_t got;
+	size_t off;
+
+	while (k->n_spill > 0 &&
+			k->n_elem - k->n_spill < (size_t) k->spill_threshold) {
+		got = ktext_spill_read(k, k->spill_buf,
+				min_t(loff_t, KTEXT_SPILL_CHUNK,
+					k->spill_wpos - k->spill_rpos),
+				k->spill_rpos);
+		if (got <= 0) {
+			printk(KERN_NOTICE "ktext_spill_refill: read error: %zd\n", got);
+			return;
+		}
+
+		off = 0;
+		while (off + sizeof(hdr) <= got &&
+				k->n_elem - k->n_spill < (size_t) k->spill_threshold) {
+			memcpy(&hdr, k->spill_buf + off, sizeof(hdr));
+			if (off + sizeof(hdr) + hdr.len > got)
+				/* truncated by the chunk, next round */
+				break;
+
+			ttl = 0;
+			if (hdr.flags & KTEXT_SPILL_TTL) {
+				if (time_after_eq(jiffies, (unsigned long) hdr.expires)) {
+					k->n_spill--;
+					k->n_elem--;
+					k->n_bytes -= hdr.len;
+					atomic_dec(&k->n_slots);
+					k->n_expired++;
+					ktext_watermark_check(k);
+					goto ktext_spill_refill_next;
+				}
+				ttl = (unsigned long) hdr.expires - jiffies;
+			}
+
+			n = ktext_node_alloc(k, hdr.len);
+			if (n == NULL)
+				return;
+			memcpy(n->text, k->spill_buf + off + sizeof(hdr), hdr.len);
+			n->text[hdr.len] = '\0';
+
+			ktext_object_node_init(n, n->text, hdr.len, hdr.prio, ttl);
+			n->queued = (unsigned long) hdr.queued;
+			k->n_spill--;
+			k->n_elem--;
+			k->n_bytes -= hdr.len;
+			/* the slot moves along with the text */
+			ktext_node_link(k, n, ttl, true);
+
+ktext_spill_refill_next:
+			off += sizeof(hdr) + hdr.len;
+			k->spill_rpos += sizeof(hdr) + hdr.len;
+		}
+	}
+
+	if (k->n_spill == 0)
+		ktext_spill_release(k);
+	else
+		ktext_spill_punch(k);
+}
+
+/**
+ * ktext_drain_pending() -	move the nodes pushed by ktext_push_atomic()
+ * 				to the FIFO.
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ *
+ * The whole pending list is detached with a single atomic exchange,
+ * then reversed, since llist_add() pushes at the front.
+ *
+ */
+static void
+ktext_drain_pending(ktext_object_t *k)
+{
+	struct llist_node *ln, *next;
+	ktext_pool_node_t *pn;
+
+	if (llist_empty(&k->pending))
+		return;
+
+	ln = llist_reverse_order(llist_del_all(&k->pending));
+	for (; ln != NULL; ln = next) {
+		next = ln->next;
+		pn = llist_entry(ln, ktext_pool_node_t, ll);
+		if (!ktext_make_room(k, pn->n.prio)) {
+			ktext_unreserve(k);
+			ktext_pool_put(k, pn);
+			continue;
+		}
+		/* behind the spilled texts, not ahead of them */
+		if (ktext_spill_wanted(k) && ktext_spill_push(k, pn->n.text,
+					pn->n.len, pn->n.prio, 0, true) == 0) {
+			ktext_pool_put(k, pn);
+			continue;
+		}
+		/* on spill errors, better out of order than lost */
+		ktext_node_link(k, &pn->n, 0, true);
+	}
+}
+
+int __must_check
+ktext_push_atomic(ktext_object_t *k, const char *text, size_t count,
+		unsigned int prio)
+{
+	struct ktext_pool *pool;
+	struct llist_node *ln;
+	ktext_pool_node_t *pn;
+	unsigned long flags;
+	size_t len;
+	u32 len32;
+
+	if (count > KTEXT_ATOMIC_SIZE)
+		return -EMSGSIZE;
+	if (!ktext_reserve(k))
+		return -ENOSPC;
+
+	if (k->pool == NULL) {
+		/* no atomic_pool= */
+		ktext_unreserve(k);
+		return -ENOBUFS;
+	}
+
+	local_irq_save(flags);
+	pool = this_cpu_ptr(k->pool);
+	if (pool->free == NULL)
+		pool->free = llist_del_all(&pool->returned);
+	ln = pool->free;
+	if (ln != NULL)
+		pool->free = ln->next;
+	local_irq_restore(flags);
+
+	if (ln == NULL) {
+		ktext_unreserve(k);
+		return -ENOBUFS;
+	}
+
+	pn = llist_entry(ln, ktext_pool_node_t, ll);
+	len = count;
+	if (READ_ONCE(k->coalesce_size)) {
+		/* a record of its own, framed like the others */
+		len32 = count;
+		memcpy(pn->text, &len32, sizeof(len32));
+		len += sizeof(len32);
+	}
+	memcpy(pn->text + len - count, text, count);
+	pn->text[len] = '\0';
+	ktext_object_node_init(&pn->n, pn->text, len, prio, 0);
+	pn->n.pooled = true;
+	llist_add(&pn->ll, &k->pending);
+
+	atomic_notifier_call_chain(&k->enqueue_nh, prio, k);
+	return 0;
+}
+
+/**
+ * ktext_coalesce_flush() - queue the record being filled
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @prio:	the priority level of the record
+ *
+ * The record takes the FIFO slot reserved by its first text, and
+ * is subject to max_elements and spilling as any other one.
+ * Returns 1 if a record has been queued, 0 otherwise.
+ *
+ */
+static int
+ktext_coalesce_flush(ktext_object_t *k, unsigned int prio)
+{
+	ktext_object_node_t *b;
+	unsigned long ttl;
+
+	b = k->batch[prio];
+	if (b == NULL)
+		return 0;
+	k->batch[prio] = NULL;
+	ttl = b->expires - b->queued;
+
+	if (!ktext_make_room(k, prio))
+		goto ktext_coalesce_flush_drop;
+
+	if (ktext_spill_wanted(k) &&
+			ktext_spill_push(k, b->text, b->len, prio, ttl, true) == 0) {
+		/* the spill file has a copy */
+		if (b->owner)
+			ktext_quota_dequeued(b->owner);
+		b->owner = NULL;
+		ktext_object_node_destroy(k, b);
+		return 1;
+	}
+
+	/* on spill errors, better out of order than lost, as in
+	 * ktext_drain_pending() */
+	b = ktext_node_compress(k, b);
+	ktext_node_link(k, b, ttl, true);
+	return 1;
+
+ktext_coalesce_flush_drop:
+	ktext_unreserve(k);
+	if (b->owner)
+		ktext_quota_dequeued(b->owner);
+	b->owner = NULL;
+	ktext_object_node_destroy(k, b);
+	return 0;
+}
+
+/**
+ * ktext_coalesce() - append a text to the record being filled
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @text:	the text
+ * @count:	the length of @text
+ * @prio:	the priority level of @text
+ * @ttl:	time-to-live of @text in jiffies, 0 for none
+ * @reserved:	a slot for @text has been taken by ktext_reserve()
+ * @owner:	the quota of the writer, NULL if none
+ *
+ * A record with a different time-to-live or owner, or without
+ * room left, is queued first and a new one is started. Texts
+ * longer than the record size get a record of their own, queued
+ * right away. The reservation, if any, is always consumed.
+ * @flushed is set if a record has been queued, even on failure.
+ *
+ */
+static int
+ktext_coalesce(ktext_object_t *k, const char *text, size_t count,
+		unsigned int prio, unsigned long ttl, bool reserved,
+		ktext_quota_t *owner, bool *flushed)
+{
+	ktext_object_node_t *b;
+	size_t need;
+	u32 len32;
+
+	*flushed = false;
+	need = sizeof(len32) + count;
+	b = k->batch[prio];
+	if (b && (b->owner != owner || b->expires - b->queued != ttl ||
+				b->len + need > k->coalesce_size)) {
+		*flushed = ktext_coalesce_flush(k, prio);
+		b = NULL;
+	}
+
+	if (b == NULL) {
+		b = ktext_node_alloc(k, max(need, k->coalesce_size));
+		if (b == NULL) {
+			if (reserved)
+				ktext_unreserve(k);
+			return -ENOMEM;
+		}
+		ktext_object_node_init(b, b->text, 0, prio, ttl);
+		b->owner = owner;
+		if (owner)
+			ktext_quota_enqueued(owner);
+		/* the record takes the slot of its first text */
+		if (!reserved)
+			atomic_inc(&k->n_slots);
+		k->batch[prio] = b;
+		schedule_delayed_work(&k->coalesce_work, k->coalesce_delay);
+	} else if (reserved)
+		/* riding in the slot of the record */
+		ktext_unreserve(k);
+
+	len32 = count;
+	memcpy(b->text + b->len, &len32, sizeof(len32));
+	memcpy(b->text + b->len + sizeof(len32), text, count);
+	b->len += need;
+	b->text[b->len] = '\0';
+
+	if (b->len + sizeof(len32) >= k->coalesce_size)
+		/* full, no point in waiting */
+		*flushed |= ktext_coalesce_flush(k, prio);
+	return 0;
+}
+
+/**
+ * ktext_coalesce_sweep() - queue the records being filled
+ *
+ * @work:	the coalesce_work member of ktext_object_t
+ *
+ * Scheduled when a record is started, so no text waits more
+ * than k->coalesce_delay.
+ *
+ */
+static void
+ktext_coalesce_sweep(struct work_struct *work)
+{
+	ktext_object_t *k;
+	unsigned int prio;
+	DECLARE_BITMAP(flushed, KTEXT_PRIO_LEVELS);
+
+	k = container_of(work, ktext_object_t, coalesce_work.work);
+	bitmap_zero(flushed, KTEXT_PRIO_LEVELS);
+
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	for (prio = 0; prio < KTEXT_PRIO_LEVELS; prio++)
+		if (ktext_coalesce_flush(k, prio))
+			__set_bit(prio, flushed);
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+
+	for_each_set_bit(prio, flushed, KTEXT_PRIO_LEVELS)
+		atomic_notifier_call_chain(&k->enqueue_nh, prio, k);
+}
+
+int __must_check
+ktext_push(ktext_object_t *k, const char *text, size_t count, unsigned int prio,
+		unsigned long ttl, bool reserved, ktext_quota_t *owner)
+{
+	ktext_object_node_t *n;
+	char *ctext;
+	size_t clen;
+	int status;
+	int lock_status;
+	bool queued;
+
+	status = 0;
+	queued = false;
+
+	/* CRIT:ON */
+	lock_status = mutex_lock_interruptible(&k->prot);
+	if (lock_status < 0) {
+		/* interrupted */
+		status = lock_status;
+		goto ktext_push_quit_noalloc;
+	}
+	/* keep ordering with the atomic pushes done so far */
+	ktext_drain_pending(k);
+
+	if (k->coalesce_size) {
+		status = ktext_coalesce(k, text, count, prio, ttl, reserved,
+				owner, &queued);
+		/* the reservation, if any, has been consumed */
+		reserved = false;
+		goto ktext_push_quit_clean;
+	}
+
+	if (!ktext_make_room(k, prio)) {
+#ifdef KTEXT_DEBUG
+		printk(KERN_NOTICE "ktext_push: FIFO full, dropping: %.*s\n",
+				(int) count, text);
+#endif
+		goto ktext_push_quit_clean;
+	}
+
+	if (ktext_spill_wanted(k)) {
+		status = ktext_spill_push(k, text, count, prio, ttl, reserved);
+		if (status == 0) {
+			/* the reservation, if any, now belongs to the spill */
+			reserved = false;
+			queued = true;
+		}
+		goto ktext_push_quit_clean;
+	}
+
+#ifdef KTEXT_DEBUG
+	printk(KERN_NOTICE "ktext_push: preparing to allocate: %zdb, for: %.*s\n",
+			count, (int) count, text);
+#endif
+	if (k->intern_hash && count <= k->intern_max) {
+		/* shared with the identical texts queued */
+		n = ktext_intern_node(k, text, count, prio, ttl);
+		if (IS_ERR(n)) {
+			printk(KERN_NOTICE "ktext_push: cannot allocate memory (damn)\n");
+			status = PTR_ERR(n);
+			goto ktext_push_quit_clean;
+		}
+		if (n)
+			goto ktext_push_link;
+		/* not interned, see KTEXT_INTERN_CHAIN_MAX */
+	}
+
+	ctext = ktext_compress(k, text, count, &clen);
+	if (ctext == NULL) {
+		ctext = (char *) text;
+		clen = count;
+	}
+	n = ktext_node_alloc(k, clen);
+	if (n == NULL) {
+		printk(KERN_NOTICE "ktext_push: cannot allocate memory (damn)\n");
+		status = -ENOMEM;
+		goto ktext_push_quit_clean;
+	}
+	memcpy(n->text, ctext, clen);
+	n->text[clen] = '\0';
+
+	ktext_object_node_init(n, n->text, clen, prio, ttl);
+	if (clen != count)
+		n->raw_len = count;
+
+ktext_push_link:
+	n->owner = owner;
+	if (owner)
+		ktext_quota_enqueued(owner);
+	ktext_node_link(k, n, ttl, reserved);
+	/* the reservation, if any, now belongs to n */
+	reserved = false;
+	queued = true;
+
+ktext_push_quit_clean:
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+
+ktext_push_quit_noalloc:
+	if (reserved)
+		/* not queued, give the slot back */
+		ktext_unreserve(k);
+	if (queued)
+		/* outside of prot, callbacks may want to pop */
+		atomic_notifier_call_chain(&k->enqueue_nh, prio, k);
+	return status;
+}
+
+/**
+ * __ktext_pop_head() - find the node at the head of the FIFO
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @max_len:	the maximum text length accepted
+ * @n:		where to store the node, NULL if the FIFO is empty
+ *
+ * Pending atomic pushes are moved to the FIFO first, spilled texts
+ * read back if needed, expired nodes met on the way are reclaimed.
+ * If the text at the head is longer than @max_len, -EMSGSIZE is
+ * returned. The node is left linked.
+ *
+ */
+static int
+__ktext_pop_head(ktext_object_t *k, size_t max_len, ktext_object_node_t **n)
+{
+	unsigned int prio;
+
+	*n = NULL;
+	ktext_drain_pending(k);
+	if (k->n_spill > 0 && k->n_elem - k->n_spill <=
+			(size_t) k->spill_threshold / 2)
+		ktext_spill_refill(k);
+
+	for (;;) {
+		prio = find_first_bit(k->prio_map, KTEXT_PRIO_LEVELS);
+		if (prio >= KTEXT_PRIO_LEVELS) {
+#ifdef KTEXT_DEBUG
+			printk(KERN_NOTICE "ktext_pop: list is empty, elems: %zd!\n", k->n_elem);
+#endif
+			return 0;
+		}
+
+		*n = list_first_entry(&k->head[prio], ktext_object_node_t, kl);
+		if (!ktext_node_expired(*n))
+			break;
+		/* stale, the sweep didn't get to it yet */
+		ktext_node_unlink(k, *n);
+		ktext_object_node_destroy(k, *n);
+		k->n_expired++;
+	}
+
+	if (ktext_node_len(*n) > max_len) {
+		/* leave it at the head */
+		*n = NULL;
+		return -EMSGSIZE;
+	}
+	return 0;
+}
+
+/**
+ * __ktext_pop() - unlink the text at the head of the FIFO
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @max_len:	the maximum text length accepted
+ * @text:	where to store the text, NULL if the FIFO is empty
+ * @len:	where to store the length of @text
+ *
+ * @lease:	lease duration in jiffies, 0 to dequeue for good
+ * @seq:	where to store the lease sequence number, if @lease
+ *
+ * See __ktext_pop_head(). The text is always a kmalloc()ed buffer:
+ * texts inline in pooled and arena nodes, or taken from the
+ * reserve, are copied out, releasing their node. So are leased
+ * texts, whose node goes in flight.
+ *
+ */
+static int
+__ktext_pop(ktext_object_t *k, size_t max_len, char **text, size_t *len,
+		unsigned long lease, u64 *seq)
+{
+	ktext_object_node_t *n;
+	bool copy;
+	int status;
+
+	*text = NULL;
+	status = __ktext_pop_head(k, max_len, &n);
+	if (n == NULL)
+		return status;
+
+	copy = n->pooled || n->chunk || k->node_pool || lease || n->raw_len ||
+		n->shared;
+	if (copy) {
+		/* copy before unlinking, on failure it stays there */
+		*text = kmalloc_node(ktext_node_len(n) + 1, GFP_KERNEL, k->node);
+		if (*text == NULL)
+			return -ENOMEM;
+		if (n->raw_len) {
+			status = ktext_decompress(k, n, *text);
+			if (status != 0) {
+				/* lost anyway, don't let it clog the FIFO */
+				kfree(*text);
+				*text = NULL;
+				ktext_node_unlink(k, n);
+				ktext_object_node_destroy(k, n);
+				k->n_dropped++;
+				return status;
+			}
+			(*text)[n->raw_len] = '\0';
+		} else
+			memcpy(*text, n->text, n->len + 1);
+	} else
+		*text = n->text;
+	*len = ktext_node_len(n);
+
+	if (lease) {
+		*seq = ktext_node_lease(k, n, lease);
+		return 0;
+	}
+	ktext_node_unlink(k, n);
+	if (copy)
+		ktext_object_node_destroy(k, n);
+	else
+		/* the text went to the caller */
+		kfree(n);
+	return 0;
+}
+
+/**
+ * __ktext_pop_copy() - copy out the text at the head of the FIFO
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @n:		the node returned by __ktext_pop_head()
+ * @buf:	where to copy the text, large enough for it
+ * @len:	where to store the length of the text
+ * @lease:	lease duration in jiffies, 0 to dequeue for good
+ * @seq:	where to store the lease sequence number, if @lease
+ *
+ * The node is then released, or leased. No memory is allocated.
+ *
+ */
+static int
+__ktext_pop_copy(ktext_object_t *k, ktext_object_node_t *n, char *buf,
+		size_t *len, unsigned long lease, u64 *seq)
+{
+	int status;
+
+	if (n->raw_len) {
+		status = ktext_decompress(k, n, buf);
+		if (status != 0) {
+			/* lost anyway, don't let it clog the FIFO */
+			ktext_node_unlink(k, n);
+			ktext_object_node_destroy(k, n);
+			k->n_dropped++;
+			return status;
+		}
+	} else
+		memcpy(buf, n->text, n->len);
+	*len = ktext_node_len(n);
+	if (lease)
+		*seq = ktext_node_lease(k, n, lease);
+	else {
+		ktext_node_unlink(k, n);
+		ktext_object_node_destroy(k, n);
+	}
+	return 0;
+}
+
+int __must_check
+ktext_pop_into(ktext_object_t *k, char *buf, size_t max_len, size_t *len,
+		unsigned long lease, u64 *seq)
+{
+	ktext_object_node_t *n;
+	int status;
+
+	*len = 0;
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0)
+		/* interrupted */
+		return status;
+	/* CRIT:ON */
+
+	status = __ktext_pop_head(k, max_len, &n);
+	if (n == NULL)
+		goto ktext_pop_into_quit;
+
+	status = __ktext_pop_copy(k, n, buf, len, lease, seq);
+	if (status == 0)
+		status = 1;
+
+ktext_pop_into_quit:
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	return status;
+}
+
+int __must_check
+ktext_pop_fit(ktext_object_t *k, char **text, size_t *len, size_t max_len)
+{
+	int status;
+
+	*text = NULL;
+	*len = 0;
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0) {
+		/* interrupted */
+		goto ktext_pop_quit_early;
+	}
+	/* CRIT:ON */
+
+	status = __ktext_pop(k, max_len, text, len, 0, NULL);
+
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+
+ktext_pop_quit_early:
+	return status;
+}
+
+int __must_check
+ktext_pop(ktext_object_t *k, char **text, size_t *len)
+{
+	return ktext_pop_fit(k, text, len, (size_t) -1);
+}
+
+int __must_check
+ktext_pop_batch(ktext_object_t *k, struct ktext_record *recs, unsigned int nr,
+		unsigned long lease)
+{
+	unsigned int i;
+	char *text;
+	size_t len;
+	int status;
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0)
+		/* interrupted */
+		return status;
+	/* CRIT:ON */
+
+	for (i = 0; i < nr; i++) {
+		status = __ktext_pop(k, recs[i].len, &text, &len, lease,
+				&recs[i].seq);
+		if (status != 0 || text == NULL)
+			break;
+		recs[i].text = text;
+		recs[i].len = len;
+	}
+
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	if (i == 0 && status == -EMSGSIZE)
+		return status;
+	return i;
+}
+
+int __must_check
+ktext_pop_batch_into(ktext_object_t *k, struct ktext_record *recs,
+		unsigned int nr, char *buf, size_t size, unsigned long lease)
+{
+	ktext_object_node_t *n;
+	unsigned int i;
+	size_t used;
+	int status;
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0)
+		/* interrupted */
+		return status;
+	/* CRIT:ON */
+
+	used = 0;
+	for (i = 0; i < nr; i++) {
+		status = __ktext_pop_head(k,
+				min_t(size_t, recs[i].len, size - used), &n);
+		if (n == NULL)
+			break;
+		status = __ktext_pop_copy(k, n, buf + used, &recs[i].len,
+				lease, &recs[i].seq);
+		if (status != 0)
+			break;
+		recs[i].text = buf + used;
+		used += recs[i].len;
+	}
+
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	if (i == 0 && status == -EMSGSIZE)
+		return status;
+	return i;
+}
+
+int __must_check
+ktext_get_stats(ktext_object_t *k, struct ktext_stats *st)
+{
+	int status;
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0)
+		return status;
+	/* CRIT:ON */
+	ktext_drain_pending(k);
+	st->n_elem = k->n_elem;
+	st->n_expired = k->n_expired;
+	st->n_dropped = k->n_dropped;
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	return 0;
+}
+
+int __must_check
+ktext_query(ktext_object_t *k, struct ktext_query *q)
+{
+	ktext_object_node_t *n;
+	unsigned int prio;
+	int status;
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0)
+		return status;
+	/* CRIT:ON */
+	ktext_drain_pending(k);
+	q->n_elem = k->n_elem;
+	q->n_bytes = k->n_bytes;
+	q->head_age_ms = 0;
+	prio = find_first_bit(k->prio_map, KTEXT_PRIO_LEVELS);
+	if (prio < KTEXT_PRIO_LEVELS) {
+		n = list_first_entry(&k->head[prio], ktext_object_node_t, kl);
+		q->head_age_ms = jiffies_to_msecs(jiffies - n->queued);
+	}
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	return 0;
+}
+
+int __must_check
+ktext_peek(ktext_object_t *k, unsigned int index, char *buf, size_t *len,
+		unsigned int *prio, unsigned long *queued)
+{
+	ktext_object_node_t *n;
+	unsigned int visited;
+	unsigned int p;
+	int status;
+
+	if (index >= KTEXT_PEEK_WINDOW)
+		return -ERANGE;
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0)
+		return status;
+	/* CRIT:ON */
+	ktext_drain_pending(k);
+
+	status = -ENOENT;
+	visited = 0;
+	for_each_set_bit(p, k->prio_map, KTEXT_PRIO_LEVELS) {
+		list_for_each_entry(n, &k->head[p], kl) {
+			if (visited++ == KTEXT_PEEK_WINDOW)
+				/* expired texts in the way */
+				goto ktext_peek_quit;
+			/* skip what ktext_pop() would skip */
+			if (ktext_node_expired(n) || index-- > 0)
+				continue;
+			if (n->raw_len) {
+				status = ktext_decompress(k, n, k->comp_buf);
+				if (status != 0)
+					goto ktext_peek_quit;
+				memcpy(buf, k->comp_buf, min(*len, n->raw_len));
+			} else
+				memcpy(buf, n->text, min(*len, n->len));
+			*len = ktext_node_len(n);
+			*prio = n->prio;
+			*queued = n->queued;
+			status = 0;
+			goto ktext_peek_quit;
+		}
+	}
+
+ktext_peek_quit:
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	return status;
+}
+
+int __must_check
+ktext_peek_range(ktext_object_t *k, unsigned int first, unsigned int count,
+		char *buf, size_t size, size_t *len)
+{
+	struct ktext_peek_record rec;
+	ktext_object_node_t *n;
+	unsigned int visited;
+	unsigned int index;
+	unsigned int p;
+	int copied;
+	int status;
+
+	*len = 0;
+	if (first >= KTEXT_PEEK_WINDOW)
+		return -ERANGE;
+	count = min_t(unsigned int, count, KTEXT_PEEK_WINDOW - first);
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0)
+		return status;
+	/* CRIT:ON */
+	ktext_drain_pending(k);
+
+	copied = 0;
+	index = 0;
+	visited = 0;
+	for_each_set_bit(p, k->prio_map, KTEXT_PRIO_LEVELS) {
+		list_for_each_entry(n, &k->head[p], kl) {
+			if (visited++ == KTEXT_PEEK_WINDOW || copied == count)
+				goto ktext_peek_range_quit;
+			/* skip what ktext_pop() would skip */
+			if (ktext_node_expired(n) || index++ < first)
+				continue;
+			if (*len + sizeof(rec) + ktext_node_len(n) > size) {
+				if (copied == 0)
+					status = -EMSGSIZE;
+				goto ktext_peek_range_quit;
+			}
+
+			if (n->raw_len) {
+				status = ktext_decompress(k, n,
+						buf + *len + sizeof(rec));
+				if (status != 0)
+					goto ktext_peek_range_quit;
+			} else
+				memcpy(buf + *len + sizeof(rec), n->text, n->len);
+			rec.len = ktext_node_len(n);
+			rec.prio = n->prio;
+			rec.age_ms = jiffies_to_msecs(jiffies - n->queued);
+			memcpy(buf + *len, &rec, sizeof(rec));
+			*len += sizeof(rec) + rec.len;
+			copied++;
+		}
+	}
+
+ktext_peek_range_quit:
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	if (status < 0)
+		return status;
+	return copied;
+}
+
+int __must_check
+ktext_export(ktext_object_t *k, char *buf, size_t size, size_t *len,
+		unsigned long lease, u64 *first)
+{
+	struct ktext_dump_record rec;
+	ktext_object_node_t *n, *q;
+	unsigned int prio;
+	int exported;
+	int status;
+
+	*len = 0;
+	exported = 0;
+
+	status = mutex_lock_interruptible(&k->prot);
+	if (status < 0)
+		return status;
+	/* CRIT:ON */
+
+	for (prio = 0; prio < KTEXT_PRIO_LEVELS; prio++)
+		ktext_coalesce_flush(k, prio);
+	/* as if their lease expired, see ktext_lease_sweep() */
+	list_for_each_entry_safe_reverse(n, q, &k->inflight, kl) {
+		list_del(&n->kl);
+		k->n_inflight--;
+		ktext_lease_requeue(k, n);
 	}
 
-	ktext_empty(*k);
-	kfree(*k);
+	for (;;) {
+		status = __ktext_pop_head(k, KTEXT_RECORD_SIZE, &n);
+		if (n == NULL)
+			break;
+		if (*len + sizeof(rec) + ktext_node_len(n) > size) {
+			if (exported == 0)
+				status = -EMSGSIZE;
+			break;
+		}
+
+		memset(&rec, 0, sizeof(rec));
+		rec.len = ktext_node_len(n);
+		rec.prio = n->prio;
+		if (k->coalesce_size)
+			rec.flags = KTEXT_DUMP_PACKED;
+		if (!list_empty(&n->tl))
+			rec.ttl_ms = max_t(unsigned int, 1,
+					jiffies_to_msecs(n->expires - jiffies));
+
+		if (n->raw_len) {
+			status = ktext_decompress(k, n, buf + *len + sizeof(rec));
+			if (status != 0) {
+				/* lost anyway, don't let it clog the FIFO */
+				ktext_node_unlink(k, n);
+				ktext_object_node_destroy(k, n);
+				k->n_dropped++;
+				continue;
+			}
+		} else
+			memcpy(buf + *len + sizeof(rec), n->text, n->len);
+		memcpy(buf + *len, &rec, sizeof(rec));
+		*len += sizeof(rec) + rec.len;
+
+		/* in flight until copied out, see ktext_ctl_export() */
+		if (exported++ == 0)
+			*first = ktext_node_lease(k, n, lease);
+		else
+			ktext_node_lease(k, n, lease);
+	}
+
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	if (status < 0)
+		return status;
+	return exported;
 }
 
 /**
- * ktext_object_node_init() -  initialize a previously allocated
- *                             ktext_object_node_t
+ * ktext_import_push() - push a text of a dump record
  *
- * @n:         the ktext_object_node_t object
- * @text:      the text to attach to this ktext_object_node_t
+ * @k:		the ktext_object_t object
+ * @text:	the text
+ * @len:	its length
+ * @rec:	the record header
+ *
+ * A FIFO slot is reserved first, as for writers: under
+ * KTEXT_FULL_REJECT, -ENOSPC once max_elements is reached.
  *
  */
-static void
-ktext_object_node_init(ktext_object_node_t *n, char *text) {
-	n->text = text;
+static int
+ktext_import_push(ktext_object_t *k, const char *text, size_t len,
+		const struct ktext_dump_record *rec)
+{
+	if (!ktext_reserve(k))
+		return -ENOSPC;
+	return ktext_push(k, text, len, rec->prio,
+			msecs_to_jiffies(rec->ttl_ms), true, NULL);
 }
 
 /**
- * ktext_object_node_destroy() -       deinitialize a previously
- *                                     initialized ktext_object_node_t
+ * ktext_import_packed() - push the texts of a coalesced record
  *
- * @n: the ktext_object_node_t object
+ * @k:		the ktext_object_t object
+ * @buf:	the record
+ * @rec:	its header
+ * @skip:	texts of the record already imported, updated as
+ * 		they are pushed
+ * @imported:	incremented for each text pushed
+ *
+ * The record is checked as a whole first, so that a malformed one
+ * is not half imported.
  *
  */
-static void
-ktext_object_node_destroy(ktext_object_node_t *n) {
-	if (n == NULL)
-		BUG();
-	if (n->text)
-		kfree(n->text);
-    kfree(n);
-}
-
-int __must_check
-ktext_push_allowed(ktext_object_t *k, int max_elements)
+static int
+ktext_import_packed(ktext_object_t *k, const char *buf,
+		const struct ktext_dump_record *rec, u32 *skip,
+		unsigned int *imported)
 {
-	int allowed;
-	/* CRIT:ON */
-	allowed = mutex_lock_interruptible(&k->prot);
-	if (allowed)
-		return allowed;
-	allowed = ((k->n_elem + 1) > max_elements && max_elements != 0) ? 0 : 1;
-	/* CRIT:OFF */
-	mutex_unlock(&k->prot);
-	return allowed;
+	size_t off;
+	u32 len;
+	u32 i;
+	int status;
+
+	for (off = 0; off < rec->len; off += len) {
+		if (rec->len - off < sizeof(len))
+			return -EINVAL;
+		memcpy(&len, buf + off, sizeof(len));
+		off += sizeof(len);
+		if (len > rec->len - off)
+			return -EINVAL;
+	}
+
+	for (i = 0, off = 0; off < rec->len; i++, off += len) {
+		memcpy(&len, buf + off, sizeof(len));
+		off += sizeof(len);
+		if (i < *skip)
+			continue;
+		status = ktext_import_push(k, buf + off, len, rec);
+		if (status < 0)
+			return status;
+		(*skip)++;
+		(*imported)++;
+	}
+	return 0;
 }
 
 int __must_check
-ktext_push(ktext_object_t *k, char *text, size_t count)
+ktext_import(ktext_object_t *k, const char *buf, size_t len, size_t *used,
+		u32 *skip, unsigned int *imported)
 {
-	char *own_text;
-	ktext_object_node_t *n;
+	struct ktext_dump_record rec;
 	int status;
-	int lock_status;
-	size_t zeroed_count;
-
-	status = 0;
-
-	/* CRIT:ON */
-	lock_status = mutex_lock_interruptible(&k->prot);
-	if (lock_status < 0) {
-		/* interrupted */
-		status = lock_status;
-		goto ktext_push_quit_noalloc;
-	}
 
-	zeroed_count = count + 1;
-#ifdef KTEXT_DEBUG
-	printk(KERN_NOTICE "ktext_push: preparing to kzalloc: %zdb, for: %s\n",
-			zeroed_count, text);
-#endif
-	own_text = (char *) kzalloc((sizeof(char) * zeroed_count), GFP_KERNEL);
-	if (own_text == NULL) {
-		printk(KERN_NOTICE "ktext_push: cannot allocate memory (damn)\n");
-		status = -ENOMEM;
-		goto ktext_push_quit_noalloc;
-	}
-	strcpy(own_text, text);
+	*used = 0;
+	*imported = 0;
+	while (len - *used >= sizeof(rec)) {
+		memcpy(&rec, buf + *used, sizeof(rec));
+		if (rec.prio >= KTEXT_PRIO_LEVELS || rec.pad != 0 ||
+				(rec.flags & ~KTEXT_DUMP_PACKED) ||
+				rec.len > ((rec.flags & KTEXT_DUMP_PACKED) ?
+					KTEXT_RECORD_SIZE : KTEXT_SIZE))
+			return -EINVAL;
+		if (rec.len > len - *used - sizeof(rec))
+			/* truncated, the rest comes next time */
+			break;
 
-	n = kmalloc(sizeof(ktext_object_node_t), GFP_KERNEL);
-	if (n == NULL) {
-		printk(KERN_NOTICE "ktext_push: cannot allocate memory (damn 2)\n");
-		status = -ENOMEM;
-		goto ktext_push_quit_err_sem_up;
+		if (rec.flags & KTEXT_DUMP_PACKED)
+			status = ktext_import_packed(k,
+					buf + *used + sizeof(rec), &rec,
+					skip, imported);
+		else if (*skip)
+			/* pushed already */
+			status = 0;
+		else {
+			status = ktext_import_push(k, buf + *used + sizeof(rec),
+					rec.len, &rec);
+			if (status >= 0) {
+				status = 0;
+				(*imported)++;
+			}
+		}
+		if (status < 0)
+			/* *skip tells how far into this record */
+			return status;
+		*skip = 0;
+		*used += sizeof(rec) + rec.len;
 	}
+	return 0;
+}
 
-	/* we already ensured that it's NULL terminated */
-	ktext_object_node_init(n, own_text);
-	list_add_tail(&n->kl, &k->head);
-	k->n_elem++;
-	goto ktext_push_quit_clean;
+int
+ktext_register_notifier(ktext_object_t *k, struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&k->enqueue_nh, nb);
+}
 
-ktext_push_quit_err_sem_up:
-	kfree(own_text);
+int
+ktext_unregister_notifier(ktext_object_t *k, struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&k->enqueue_nh, nb);
+}
 
-ktext_push_quit_clean:
+void
+ktext_count_dropped(ktext_object_t *k)
+{
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	k->n_dropped++;
 	/* CRIT:OFF */
 	mutex_unlock(&k->prot);
-
-ktext_push_quit_noalloc:
-	return status;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
-
-/* commit b5e618181a927210f8be1d3d2249d31904ba358d */
-
 /**
- * list_first_entry - get the first element from a list
- * @ptr:	the list head to take the element from.
- * @type:	the type of the struct this is embedded in.
- * @member:	the name of the list_struct within the struct.
+ * __ktext_lease_end() - take strings off the in-flight list
+ *
+ * @k:		the ktext_object_t object, k->prot held
+ * @first:	the first sequence number
+ * @last:	the last sequence number
+ * @requeue:	put them back at the head of the FIFO, instead of
+ * 		freeing them for good
+ * @requeued:	the priority levels requeued to, if @requeue
+ *
+ * Returns the number of strings taken off.
  *
- * Note, that list is expected to be not empty.
  */
-#define list_first_entry(ptr, type, member) \
-	list_entry((ptr)->next, type, member)
+static int
+__ktext_lease_end(ktext_object_t *k, u64 first, u64 last, bool requeue,
+		unsigned long *requeued)
+{
+	ktext_object_node_t *n, *q;
+	unsigned int prio;
+	LIST_HEAD(ended);
+	int count;
 
-#endif
+	count = 0;
+	list_for_each_entry_safe(n, q, &k->inflight, kl) {
+		if (n->seq < first)
+			continue;
+		if (n->seq > last)
+			/* in sequence order */
+			break;
+		list_move_tail(&n->kl, &ended);
+		k->n_inflight--;
+		count++;
+	}
+	/* newest first, see ktext_lease_sweep() */
+	list_for_each_entry_safe_reverse(n, q, &ended, kl) {
+		list_del(&n->kl);
+		if (!requeue) {
+			ktext_unreserve(k);
+			ktext_object_node_destroy(k, n);
+			continue;
+		}
+		prio = n->prio;
+		if (ktext_lease_requeue(k, n))
+			__set_bit(prio, requeued);
+	}
+	return count;
+}
 
 int __must_check
-ktext_pop(ktext_object_t *k, char **text)
+ktext_ack(ktext_object_t *k, u64 first, u64 last)
 {
-	ktext_object_node_t *n;
 	int status;
 
 	status = mutex_lock_interruptible(&k->prot);
-	if (status < 0) {
+	if (status < 0)
 		/* interrupted */
-		goto ktext_pop_quit_early;
-	}
+		return status;
 	/* CRIT:ON */
+	status = __ktext_lease_end(k, first, last, false, NULL);
+	/* CRIT:OFF */
+	mutex_unlock(&k->prot);
+	return status;
+}
 
-	*text = NULL;
-	if (list_empty(&k->head)) {
-		printk(KERN_NOTICE "ktext_pop: list is empty, elems: %zd!\n", k->n_elem);
-		goto ktext_pop_quit;
-	}
+void
+ktext_lease_end(ktext_object_t *k, u64 first, u64 last, bool requeue)
+{
+	unsigned int prio;
+	DECLARE_BITMAP(requeued, KTEXT_PRIO_LEVELS);
 
-	n = list_first_entry(&k->head, ktext_object_node_t, kl);
-	list_del(&n->kl);
-	k->n_elem--;
-	*text = n->text;
-	kfree(n);
+	bitmap_zero(requeued, KTEXT_PRIO_LEVELS);
 
-ktext_pop_quit:
+	mutex_lock(&k->prot);
+	/* CRIT:ON */
+	__ktext_lease_end(k, first, last, requeue, requeued);
 	/* CRIT:OFF */
 	mutex_unlock(&k->prot);
 
-ktext_pop_quit_early:
-	return status;
+	for_each_set_bit(prio, requeued, KTEXT_PRIO_LEVELS)
+		atomic_notifier_call_chain(&k->enqueue_nh, prio, k);
 }
 
 void
@@ -280,23 +2882,49 @@ ktext_empty(ktext_object_t *k)
 
 	struct list_head *lh, *q;
 	ktext_object_node_t *n;
+	unsigned int prio;
 
 	mutex_lock(&k->prot);
+	ktext_drain_pending(k);
+	ktext_spill_release(k);
+	list_for_each_safe(lh, q, &k->inflight) {
+		/* never to be acked */
+		n = list_entry(lh, ktext_object_node_t, kl);
+		list_del(&n->kl);
+		ktext_unreserve(k);
+		ktext_object_node_destroy(k, n);
+	}
+	k->n_inflight = 0;
+	for (prio = 0; prio < KTEXT_PRIO_LEVELS; prio++) {
+		/* not queued yet, just drop them */
+		n = k->batch[prio];
+		if (n == NULL)
+			continue;
+		k->batch[prio] = NULL;
+		ktext_unreserve(k);
+		if (n->owner)
+			ktext_quota_dequeued(n->owner);
+		n->owner = NULL;
+		ktext_object_node_destroy(k, n);
+	}
 
-	if (list_empty(&k->head)) {
+	if (find_first_bit(k->prio_map, KTEXT_PRIO_LEVELS) >= KTEXT_PRIO_LEVELS) {
 		printk(KERN_NOTICE "ktext_empty: list is empty\n");
 		goto ktext_empty_quit;
 	}
 
-    list_for_each_safe(lh, q, &k->head) {
-        n = list_entry(lh, ktext_object_node_t, kl);
+	for_each_set_bit(prio, k->prio_map, KTEXT_PRIO_LEVELS) {
+		list_for_each_safe(lh, q, &k->head[prio]) {
+			n = list_entry(lh, ktext_object_node_t, kl);
 #ifdef KTEXT_DEBUG
-		printk(KERN_NOTICE "ktext_empty: popping: %s\n", n->text);
+			printk(KERN_NOTICE "ktext_empty: popping: %.*s\n",
+					(int) n->len, n->text);
 #endif
-        list_del(lh);
-        ktext_object_node_destroy(n);
-        n = NULL;
-    }
+			ktext_node_unlink(k, n);
+			ktext_object_node_destroy(k, n);
+			n = NULL;
+		}
+	}
 
 ktext_empty_quit:
 	mutex_unlock(&k->prot);
@@ -377,11 +3005,214 @@ ktext_writer_trylock_early_quit:
 #endif
 }
 
+/**
+ * ktext_lock_spin() -	spin on the given trylock function for a short
+ * 			while before giving up.
+ *
+ * @k:		the ktext_object_t object
+ * @trylock:	ktext_reader_trylock() or ktext_writer_trylock()
+ *
+ * Critical sections are usually very short, it is cheaper
+ * to busy-wait a little than to go through a full sleep and
+ * wakeup cycle. Return 1 if the lock has been acquired.
+ *
+ */
+static int
+ktext_lock_spin(ktext_object_t *k, int (*trylock)(ktext_object_t *))
+{
+	int i;
+
+	for (i = 0; i < KTEXT_LOCK_SPIN; i++) {
+		if (trylock(k))
+			return 1;
+		cpu_relax();
+	}
+	return 0;
+}
+
+#ifdef KTEXT_ALT_RW_STARV_PROT
+
+/**
+ * ktext_sem_wait() -	killable, optionally time bounded, down()
+ *
+ * @sem:	the semaphore
+ * @timeout:	deadline in jiffies, 0 means no deadline
+ *
+ * There is no killable version of down_timeout(), so the wait
+ * is split in KTEXT_LOCK_SLICE long slices, checking for fatal
+ * signals in between.
+ *
+ * Returns 0 on success, -EINTR if killed, -ETIMEDOUT if the
+ * deadline expired.
+ */
+static int
+ktext_sem_wait(struct semaphore *sem, unsigned long timeout)
+{
+	unsigned long deadline;
+	long slice;
+
+	if (!timeout)
+		return down_killable(sem);
+
+	deadline = jiffies + timeout;
+	for (;;) {
+		slice = (long) (deadline - jiffies);
+		if (slice <= 0)
+			return -ETIMEDOUT;
+		if (slice > KTEXT_LOCK_SLICE)
+			slice = KTEXT_LOCK_SLICE;
+		if (!down_timeout(sem, slice))
+			return 0;
+		if (fatal_signal_pending(current))
+			return -EINTR;
+	}
+}
+
+/**
+ * __ktext_reader_unlock() - release a reader lock, k->__m held.
+ */
+static void
+__ktext_reader_unlock(ktext_object_t *k)
+{
+	k->__nr--;
+	if (k->__nbw > 0 && k->__nr == 0) {
+		k->__nbw--;
+		k->__nw++;
+		up(&k->__priv_w);
+	}
+}
+
+/**
+ * __ktext_writer_unlock() - release a writer lock, k->__m held.
+ */
+static void
+__ktext_writer_unlock(ktext_object_t *k)
+{
+	k->__nw--;
+	if (k->__nbr > 0) {
+		while (k->__nbr > 0) {
+			k->__nbr--;
+			k->__nr++;
+			up(&k->__priv_r);
+		}
+	} else if (k->__nbw > 0) {
+		k->__nbw--;
+		k->__nw++;
+		up(&k->__priv_w);
+	}
+}
+
+/**
+ * ktext_reader_abort() - rollback a failed ktext_reader_lock()
+ *
+ * @k:	the ktext_object_t object
+ *
+ * Tokens on __priv_r are anonymous: as long as somebody is
+ * still accounted as blocked, we just take its place out of
+ * __nbr. Otherwise a token has been granted in the meantime,
+ * consume it and release the lock as a regular reader would.
+ *
+ */
+static void
+ktext_reader_abort(ktext_object_t *k)
+{
+	mutex_lock(&k->__m);
+	if (k->__nbr > 0)
+		k->__nbr--;
+	else if (!down_trylock(&k->__priv_r))
+		__ktext_reader_unlock(k);
+	else
+		BUG();
+	mutex_unlock(&k->__m);
+}
+
+/**
+ * ktext_writer_abort() - rollback a failed ktext_writer_lock()
+ *
+ * @k:	the ktext_object_t object
+ *
+ * Same as ktext_reader_abort(). Readers arriving while we were
+ * blocked queued up behind us, if we were the last blocked
+ * writer and nobody is writing, let them in.
+ *
+ */
+static void
+ktext_writer_abort(ktext_object_t *k)
+{
+	mutex_lock(&k->__m);
+	if (k->__nbw > 0) {
+		k->__nbw--;
+		if (k->__nbw == 0 && k->__nw == 0) {
+			while (k->__nbr > 0) {
+				k->__nbr--;
+				k->__nr++;
+				up(&k->__priv_r);
+			}
+		}
+	} else if (!down_trylock(&k->__priv_w))
+		__ktext_writer_unlock(k);
+	else
+		BUG();
+	mutex_unlock(&k->__m);
+}
+
+#else
+
+/**
+ * ktext_rwsem_wait() -	killable, optionally time bounded, rwsem
+ * 			acquisition.
+ *
+ * @k:		the ktext_object_t object
+ * @write:	acquire the write end
+ * @timeout:	deadline in jiffies, 0 means no deadline
+ *
+ * rw_semaphore has no timed version, when a deadline is set
+ * (or the killable variants are missing) we sleep one tick
+ * at a time between trylocks.
+ *
+ * Returns 0 on success, -EINTR if killed, -ETIMEDOUT if the
+ * deadline expired.
+ */
+static int
+ktext_rwsem_wait(ktext_object_t *k, bool write, unsigned long timeout)
+{
+	unsigned long deadline;
+	int acquired;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+	if (!timeout) {
+		if (write)
+			return down_write_killable(&k->__ktext_rwsem);
+		return down_read_killable(&k->__ktext_rwsem);
+	}
+#endif
+
+	deadline = jiffies + timeout;
+	for (;;) {
+		if (write)
+			acquired = down_write_trylock(&k->__ktext_rwsem);
+		else
+			acquired = down_read_trylock(&k->__ktext_rwsem);
+		if (acquired)
+			return 0;
+		if (timeout && time_after_eq(jiffies, deadline))
+			return -ETIMEDOUT;
+		schedule_timeout_killable(1);
+		if (fatal_signal_pending(current))
+			return -EINTR;
+	}
+}
+
+#endif /* KTEXT_ALT_RW_STARV_PROT */
+
 int __must_check
-ktext_reader_lock(ktext_object_t *k) {
+ktext_reader_lock(ktext_object_t *k, unsigned long timeout) {
 #ifdef KTEXT_ALT_RW_STARV_PROT
 	int status;
 
+	if (ktext_lock_spin(k, ktext_reader_trylock))
+		return 0;
+
 	status = mutex_lock_interruptible(&k->__m);
 	if (status)
 		return status;
@@ -393,20 +3224,27 @@ ktext_reader_lock(ktext_object_t *k) {
 		up(&k->__priv_r);
 	}
 	mutex_unlock(&k->__m);
-	down(&k->__priv_r);
+
+	status = ktext_sem_wait(&k->__priv_r, timeout);
+	if (status)
+		ktext_reader_abort(k);
 
 	return status;
 #else
-	down_read(&k->__ktext_rwsem);
-	return 0;
+	if (ktext_lock_spin(k, ktext_reader_trylock))
+		return 0;
+	return ktext_rwsem_wait(k, false, timeout);
 #endif
 }
 
 int __must_check
-ktext_writer_lock(ktext_object_t *k) {
+ktext_writer_lock(ktext_object_t *k, unsigned long timeout) {
 #ifdef KTEXT_ALT_RW_STARV_PROT
 	int status;
 
+	if (ktext_lock_spin(k, ktext_writer_trylock))
+		return 0;
+
 	status = mutex_lock_interruptible(&k->__m);
 	if (status)
 		return status;
@@ -418,12 +3256,16 @@ ktext_writer_lock(ktext_object_t *k) {
 		up(&k->__priv_w);
 	}
 	mutex_unlock(&k->__m);
-	down(&k->__priv_w);
+
+	status = ktext_sem_wait(&k->__priv_w, timeout);
+	if (status)
+		ktext_writer_abort(k);
 
 	return status;
 #else
-	down_write(&k->__ktext_rwsem);
-	return 0;
+	if (ktext_lock_spin(k, ktext_writer_trylock))
+		return 0;
+	return ktext_rwsem_wait(k, true, timeout);
 #endif
 }
 
@@ -431,12 +3273,7 @@ void
 ktext_reader_unlock(ktext_object_t *k) {
 #ifdef KTEXT_ALT_RW_STARV_PROT
 	mutex_lock(&k->__m);
-	k->__nr--;
-	if (k->__nbw > 0 && k->__nr == 0) {
-		k->__nbw--;
-		k->__nw++;
-		up(&k->__priv_w);
-	}
+	__ktext_reader_unlock(k);
 	mutex_unlock(&k->__m);
 #else
 	up_read(&k->__ktext_rwsem);
@@ -447,18 +3284,7 @@ void
 ktext_writer_unlock(ktext_object_t *k) {
 #ifdef KTEXT_ALT_RW_STARV_PROT
 	mutex_lock(&k->__m);
-	k->__nw--;
-	if (k->__nbr > 0) {
-		while (k->__nbr > 0) {
-			k->__nbr--;
-			k->__nr++;
-			up(&k->__priv_r);
-		}
-	} else if (k->__nbw > 0) {
-		k->__nbw--;
-		k->__nw++;
-		up(&k->__priv_w);
-	}
+	__ktext_writer_unlock(k);
 	mutex_unlock(&k->__m);
 #else
 	up_write(&k->__ktext_rwsem);
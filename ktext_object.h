@@ -25,8 +25,12 @@
 #include <linux/rwsem.h>
 #include <linux/mutex.h>
 #include <linux/list.h>
+#include <linux/notifier.h>
+#include <linux/eventfd.h>
 
 #include "ktext_config.h"
+#include "ktext_ioctl.h"
+#include "ktext_quota.h"
 
 /**
  * struct ktext_object -	the ktree FIFO object implemented with
@@ -34,15 +38,46 @@
  */
 typedef struct ktext_object ktext_object_t;
 
+/**
+ * enum ktext_full_policy - what ktext_push() does when the FIFO is full
+ *
+ * @KTEXT_FULL_REJECT:		writers get -ENOSPC on open()
+ * @KTEXT_FULL_DROP_OLDEST:	evict the oldest text of the least
+ * 				urgent level
+ * @KTEXT_FULL_DROP_NEWEST:	silently drop the text being pushed
+ */
+enum ktext_full_policy {
+	KTEXT_FULL_REJECT = 0,
+	KTEXT_FULL_DROP_OLDEST = 1,
+	KTEXT_FULL_DROP_NEWEST = 2,
+};
+
+/**
+ * struct ktext_record - a text popped out of the FIFO
+ *
+ * @text:	the text, to be kfree()d by the receiver
+ * @len:	the length of @text
+ * @seq:	the lease sequence number, if leased
+ */
+struct ktext_record {
+	char *text;
+	size_t len;
+	u64 seq;
+};
+
 /**
  * ktext_object_init() - initialize a previously allocated
  * 			 ktext_object.
  *
- * @k:	the ktext_object object
+ * @k:		the ktext_object object
+ * @node:	NUMA node the FIFO and the texts queued on it shall
+ * 		be allocated on, NUMA_NO_NODE for no preference
+ * @reserve:	number of texts a preallocated memory reserve shall
+ * 		guarantee room for, 0 for no reserve
  *
  */
 int __must_check
-ktext_object_init(ktext_object_t **k);
+ktext_object_init(ktext_object_t **k, int node, unsigned int reserve);
 
 /**
  * ktext_object_destroy() - 	deinitialize a previously initialized
@@ -53,49 +88,477 @@ void
 ktext_object_destroy(ktext_object_t **k);
 
 /**
- * ktext_push_allowed() - is there space left on the FIFO?
+ * ktext_set_limit() - set the FIFO size limit
  *
  * @k:			the ktext_object_t object
- * @max_elements:	maximum amount of elements allowed
+ * @max_elements:	maximum amount of elements allowed, 0 for unlimited
+ * @full_policy:	what to do once full, see enum ktext_full_policy
+ *
+ */
+void
+ktext_set_limit(ktext_object_t *k, int max_elements, int full_policy);
+
+/**
+ * ktext_set_spill() - set the spill threshold
+ *
+ * @k:			the ktext_object_t object
+ * @threshold:		number of texts kept in memory, 0 disables
+ * 			spilling
+ *
+ * Once @threshold texts are queued in memory, the following ones
+ * are appended to a shmem file (swappable memory) and read back,
+ * in order, as readers drain the FIFO below @threshold / 2.
+ * Spilled texts are not reordered by priority until read back.
+ *
+ */
+void
+ktext_set_spill(ktext_object_t *k, int threshold);
+
+/**
+ * ktext_set_coalesce() - turn coalescing on
+ *
+ * @k:			the ktext_object_t object, nothing pushed yet
+ * @size:		size of the coalesced records, at most
+ * 			KTEXT_RECORD_SIZE, 0 leaves coalescing off
+ * @delay:		maximum time, in jiffies, a text waits in a
+ * 			record not full yet
+ *
+ * From then on every record is a sequence of texts, each one
+ * preceded by its length as a host endian __u32. Consecutive
+ * texts with the same priority level, time-to-live and writer
+ * quota are packed in the same record until it is full or
+ * @delay has passed. Longer texts get a record of their own.
+ * The FIFO counters, max_elements and the quotas count records.
  *
- * This function returns true if the ktext_object_t has
- * space for another text string.
+ */
+void
+ktext_set_coalesce(ktext_object_t *k, size_t size, unsigned long delay);
+
+/**
+ * ktext_set_atomic_pool() - preallocate the nodes of ktext_push_atomic()
+ *
+ * @k:			the ktext_object object
+ * @nr:			number of nodes per possible CPU, 0 leaves
+ * 			ktext_push_atomic() off
  *
+ * To be called once, before the first ktext_push_atomic(), which
+ * fails with -ENOBUFS otherwise. Each node holds a text of up to
+ * KTEXT_ATOMIC_SIZE bytes.
+ * Returns 0 on success, -ENOMEM.
  */
 int __must_check
-ktext_push_allowed(ktext_object_t *k, int max_elements);
+ktext_set_atomic_pool(ktext_object_t *k, unsigned int nr);
 
 /**
- * ktext_push() - push a string to the FIFO
+ * ktext_set_intern() - turn interning on
+ *
+ * @k:			the ktext_object_t object, nothing pushed yet
+ * @max_len:		maximum length of the texts to be interned,
+ * 			0 leaves interning off
+ *
+ * Texts up to @max_len bytes are stored once: identical texts
+ * queued at the same time share a single refcounted copy, freed
+ * when the last of them is popped. Coalesced records are not
+ * interned, interned texts are not compressed.
+ *
+ */
+int __must_check
+ktext_set_intern(ktext_object_t *k, size_t max_len);
+
+/**
+ * ktext_set_compress() - turn compression on
+ *
+ * @k:			the ktext_object_t object, nothing pushed yet
+ * @threshold:		minimum length of the texts to be compressed,
+ * 			0 leaves compression off
+ *
+ * Texts (and coalesced records) at least @threshold bytes long are
+ * stored compressed with KTEXT_COMPRESS_ALG, if that saves memory,
+ * and decompressed when popped. Spilled texts are stored as they
+ * are. Returns -ENOENT if the algorithm is not available.
+ *
+ */
+int __must_check
+ktext_set_compress(ktext_object_t *k, size_t threshold);
+
+/**
+ * ktext_get_comp_stats() - get the compression counters
  *
  * @k:		the ktext_object_t object
- * @text:	the actual string
- * @count:	the size of the buffer at @text
+ * @st:		where to store the counters
  *
- * Push a single string to the FIFO at @k.
- * @count is the buffer size of @text (also accounting
- * the NULL termination).
- * Please note that ktext_push() shall be called only
- * after having checked text availability with
- * ktext_push_allowed().
- * You are responsible of avoiding the Test-And-Set race.
+ */
+int __must_check
+ktext_get_comp_stats(ktext_object_t *k, struct ktext_comp_stats *st);
+
+/**
+ * ktext_set_watermarks() - set the level notifications
+ *
+ * @k:		the ktext_object_t object
+ * @high_ctx:	eventfd to signal when the level reaches @high, or NULL
+ * @low_ctx:	eventfd to signal when the level drops back to @low,
+ * 		or NULL
+ * @high:	the high watermark, 0 to disable the notifications
+ * @low:	the low watermark, less than @high
+ * @bytes:	the level is the total length of the texts, instead
+ * 		of their number
+ *
+ * The eventfd references are taken over, the previous ones are
+ * released. The level is checked by whoever changes it, under
+ * the FIFO lock they already hold.
+ *
+ */
+void
+ktext_set_watermarks(ktext_object_t *k, struct eventfd_ctx *high_ctx,
+		struct eventfd_ctx *low_ctx, u64 high, u64 low, bool bytes);
+
+/**
+ * ktext_reserve() - reserve a FIFO slot for a text to be pushed
+ *
+ * @k:			the ktext_object_t object
+ *
+ * Lock-free admission control: returns 1 if a slot has been
+ * reserved, 0 if the FIFO is full and the full policy is
+ * KTEXT_FULL_REJECT (the other policies make room in
+ * ktext_push() instead, so they always succeed).
+ * The slot is consumed by ktext_push(..., reserved = true)
+ * or given back with ktext_unreserve().
+ *
+ */
+int __must_check
+ktext_reserve(ktext_object_t *k);
+
+/**
+ * ktext_unreserve() - give back a slot taken by ktext_reserve()
+ *
+ * @k:			the ktext_object_t object
+ *
+ */
+void
+ktext_unreserve(ktext_object_t *k);
+
+/**
+ * ktext_push() - push a string to the FIFO
+ *
+ * @k:		the ktext_object_t object
+ * @text:	the actual string, may contain NUL bytes
+ * @count:	the length of @text
+ * @prio:	priority level, 0 (most urgent) to KTEXT_PRIO_LEVELS - 1
+ * @ttl:	time-to-live in jiffies, 0 for none
+ * @reserved:	a slot has been taken with ktext_reserve()
+ * @owner:	the quota of the writer, NULL if none. A reference is
+ * 		taken as long as the text is queued in memory
+ *
+ * Push a single string to the FIFO at @k, on the @prio level.
+ * @text is copied by length, it doesn't need to be
+ * NULL terminated.
+ * The max_elements limit is enforced by ktext_reserve(),
+ * whose slot is consumed here (or given back if the text
+ * is not queued after all). When full, the drop policies
+ * evict or silently drop texts here.
  *
  * Returns >0 for true, 0 for false, <0 for error.
  */
 int __must_check
-ktext_push(ktext_object_t *k, char *text, size_t count);
+ktext_push(ktext_object_t *k, const char *text, size_t count, unsigned int prio,
+		unsigned long ttl, bool reserved, ktext_quota_t *owner);
+
+/**
+ * ktext_push_atomic() - push a string to the FIFO, from any context
+ *
+ * @k:		the ktext_object_t object
+ * @text:	the actual string, may contain NUL bytes
+ * @count:	the length of @text, at most KTEXT_ATOMIC_SIZE
+ * @prio:	priority level, 0 (most urgent) to KTEXT_PRIO_LEVELS - 1
+ *
+ * Same as ktext_push(), without time-to-live, but it never sleeps:
+ * safe from interrupt handlers and with spinlocks held. @text is
+ * copied to a node of the local CPU pool and queued on a lock-less
+ * pending list, moved to the FIFO by the next reader (or writer)
+ * taking the FIFO lock.
+ *
+ * Returns 0 on success, -EMSGSIZE if @count is too big, -ENOSPC if
+ * the FIFO is full, -ENOBUFS if the local CPU pool is exhausted, or
+ * if there is none, see ktext_set_atomic_pool().
+ */
+int __must_check
+ktext_push_atomic(ktext_object_t *k, const char *text, size_t count,
+		unsigned int prio);
 
 /**
  * ktext_pop() - extract one string from the FIFO
  *
  * @k: 		the ktext_object object
  * @text:	the text pointer to write to (NULL if nothing to write)
+ * @len:	the length of @text, as pushed
+ *
+ * Extract a single string from the FIFO, taking it from
+ * the most urgent non-empty priority level. Expired strings
+ * met on the way are reclaimed. @text shall be kfree()d by
+ * the caller.
+ *
+ */
+int __must_check
+ktext_pop(ktext_object_t *k, char **text, size_t *len);
+
+/**
+ * ktext_pop_fit() - extract one string from the FIFO, if small enough
+ *
+ * @k: 		the ktext_object object
+ * @text:	the text pointer to write to (NULL if nothing to write)
+ * @len:	the length of @text, as pushed
+ * @max_len:	the maximum length accepted
+ *
+ * Same as ktext_pop(), but if the string at the head of the FIFO is
+ * longer than @max_len, it is left there and -EMSGSIZE is returned.
+ *
+ */
+int __must_check
+ktext_pop_fit(ktext_object_t *k, char **text, size_t *len, size_t max_len);
+
+/**
+ * ktext_pop_into() - extract one string from the FIFO, into a buffer
  *
- * Extract a single string from the FIFO.
+ * @k: 		the ktext_object object
+ * @buf:	where to copy the string
+ * @max_len:	the size of @buf
+ * @len:	the length of the string
+ * @lease:	lease duration in jiffies, 0 to dequeue for good
+ * @seq:	where to store the lease sequence number, if @lease
+ *
+ * Same as ktext_pop_fit(), but the string is copied to @buf under
+ * the FIFO lock, no memory is allocated.
+ * With @lease, the string is kept in flight instead of being freed:
+ * unless acked through ktext_ack() within @lease, it is put back at
+ * the head of the FIFO, to be read again.
+ *
+ * Returns >0 if a string has been popped, 0 if the FIFO is empty,
+ * -EMSGSIZE if the string at the head is longer than @max_len,
+ * <0 if interrupted.
+ */
+int __must_check
+ktext_pop_into(ktext_object_t *k, char *buf, size_t max_len, size_t *len,
+		unsigned long lease, u64 *seq);
+
+/**
+ * ktext_pop_batch() - extract up to @nr strings from the FIFO
  *
+ * @k: 		the ktext_object object
+ * @recs:	the records to fill
+ * @nr:		the number of records at @recs
+ * @lease:	lease duration in jiffies, 0 to dequeue for good, see
+ * 		ktext_pop_into()
+ *
+ * Same as ktext_pop_fit(), for many strings at once, taking the
+ * FIFO lock only once. On input, recs[i].len is the maximum length
+ * accepted for the i-th string, (size_t) -1 meaning no limit.
+ * Stops at the first string not fitting, leaving it at the head.
+ *
+ * Returns the number of records filled, -EMSGSIZE if not even the
+ * first string fits, <0 if interrupted.
  */
 int __must_check
-ktext_pop(ktext_object_t *k, char **text);
+ktext_pop_batch(ktext_object_t *k, struct ktext_record *recs, unsigned int nr,
+		unsigned long lease);
+
+/**
+ * ktext_pop_batch_into() - extract up to @nr strings from the FIFO,
+ * 			    into a buffer
+ *
+ * @k: 		the ktext_object object
+ * @recs:	the records to fill
+ * @nr:		the number of records at @recs
+ * @buf:	where to copy the strings
+ * @size:	the size of @buf
+ * @lease:	lease duration in jiffies, 0 to dequeue for good, see
+ * 		ktext_pop_into()
+ *
+ * Same as ktext_pop_batch(), but the strings are copied back to back
+ * to @buf, recs[i].text pointing there, no memory is allocated. Also
+ * stops at the first string not fitting what is left of @buf.
+ *
+ * Returns the number of records filled, -EMSGSIZE if not even the
+ * first string fits, <0 if interrupted.
+ */
+int __must_check
+ktext_pop_batch_into(ktext_object_t *k, struct ktext_record *recs,
+		unsigned int nr, char *buf, size_t size, unsigned long lease);
+
+/**
+ * ktext_ack() - acknowledge leased strings
+ *
+ * @k: 		the ktext_object object
+ * @first:	the first sequence number to acknowledge
+ * @last:	the last sequence number to acknowledge
+ *
+ * The strings in flight whose sequence number is between @first
+ * and @last, included, are freed for good. Sequence numbers start
+ * from 1, @first = 0 acknowledges everything up to @last.
+ *
+ * Returns the number of strings acknowledged, <0 if interrupted.
+ */
+int __must_check
+ktext_ack(ktext_object_t *k, u64 first, u64 last);
+
+/**
+ * ktext_lease_end() - end the leases of strings, now
+ *
+ * @k: 		the ktext_object object
+ * @first:	the first sequence number
+ * @last:	the last sequence number
+ * @requeue:	put the strings back at the head of the FIFO, as if
+ * 		their lease expired, instead of acknowledging them
+ *
+ * Same as ktext_ack(), but never interrupted: for readers settling
+ * the batch they just popped, see KTEXT_COPY_LEASE.
+ */
+void
+ktext_lease_end(ktext_object_t *k, u64 first, u64 last, bool requeue);
+
+/**
+ * ktext_register_notifier() - get called back after each push
+ *
+ * @k: 		the ktext_object object
+ * @nb:		the notifier_block object
+ *
+ * @nb is called in atomic context, outside of the FIFO lock,
+ * with the priority level of the new text as action and @k as
+ * data. It shall not sleep, but it is allowed to schedule work
+ * that pops.
+ */
+int
+ktext_register_notifier(ktext_object_t *k, struct notifier_block *nb);
+
+/**
+ * ktext_unregister_notifier() - undo ktext_register_notifier()
+ *
+ * @k: 		the ktext_object object
+ * @nb:		the notifier_block object
+ *
+ */
+int
+ktext_unregister_notifier(ktext_object_t *k, struct notifier_block *nb);
+
+/**
+ * ktext_get_stats() - read the FIFO counters
+ *
+ * @k:		the ktext_object_t object
+ * @st:		where to store the counters
+ *
+ * Returns 0 on success, <0 if interrupted.
+ */
+int __must_check
+ktext_get_stats(ktext_object_t *k, struct ktext_stats *st);
+
+/**
+ * ktext_query() - read the FIFO occupancy
+ *
+ * @k:		the ktext_object_t object
+ * @q:		where to store it
+ *
+ * Returns 0 on success, <0 if interrupted.
+ */
+int __must_check
+ktext_query(ktext_object_t *k, struct ktext_query *q);
+
+/**
+ * ktext_peek() - copy a text out of the FIFO, without dequeuing it
+ *
+ * @k:		the ktext_object_t object
+ * @index:	position of the text, 0 being the next one to be popped
+ * @buf:	where to copy the text
+ * @len:	in: size of @buf, out: length of the text
+ * @prio:	where to store the priority level of the text
+ * @queued:	where to store the time the text was pushed, in jiffies
+ *
+ * Only the FIFO lock is taken, for the time of the walk and the copy.
+ * The walk is bounded: at most KTEXT_PEEK_WINDOW nodes are visited.
+ * Returns 0 on success, -ENOENT if there is no text at @index,
+ * -ERANGE if @index is past KTEXT_PEEK_WINDOW, <0 if interrupted.
+ */
+int __must_check
+ktext_peek(ktext_object_t *k, unsigned int index, char *buf, size_t *len,
+		unsigned int *prio, unsigned long *queued);
+
+/**
+ * ktext_peek_range() - copy texts out of the FIFO, without dequeuing
+ * 			them
+ *
+ * @k:		the ktext_object_t object
+ * @first:	position of the first text, 0 being the next one to be
+ * 		popped
+ * @count:	maximum number of texts
+ * @buf:	where to write them, as struct ktext_peek_record
+ * 		followed by the text
+ * @size:	the size of @buf
+ * @len:	where to store the number of bytes written
+ *
+ * Same bounded walk as ktext_peek(), under a single FIFO lock
+ * acquisition. Returns the number of texts copied, -ERANGE if
+ * @first is past KTEXT_PEEK_WINDOW, -EMSGSIZE if the first one
+ * doesn't fit, <0 if interrupted.
+ */
+int __must_check
+ktext_peek_range(ktext_object_t *k, unsigned int first, unsigned int count,
+		char *buf, size_t size, size_t *len);
+
+/**
+ * ktext_export() - pop texts as dump records
+ *
+ * @k:		the ktext_object_t object
+ * @buf:	where to write the records
+ * @size:	the size of @buf
+ * @len:	where to store the number of bytes written
+ *
+ * @lease:	lease duration in jiffies of the texts exported
+ * @first:	where to store the sequence number of the first one
+ *
+ * Pops as many texts as they fit in @buf, each one written as a
+ * struct ktext_dump_record followed by the text, decompressed.
+ * Records being filled are queued and leased texts requeued
+ * first, so that nothing is left behind.
+ * The texts exported stay in flight, with consecutive sequence
+ * numbers from *@first, until ktext_lease_end() acks them once
+ * @buf is safe, or requeues them.
+ * Returns the number of texts exported, -EMSGSIZE if the first
+ * one doesn't fit, <0 if interrupted.
+ */
+int __must_check
+ktext_export(ktext_object_t *k, char *buf, size_t size, size_t *len,
+		unsigned long lease, u64 *first);
+
+/**
+ * ktext_import() - push the texts of dump records
+ *
+ * @k:		the ktext_object_t object
+ * @buf:	the records, as written by ktext_export()
+ * @len:	the length of @buf
+ * @used:	where to store the number of bytes consumed
+ * @skip:	texts of the first record imported already; on return,
+ * 		those of the record the import stopped in
+ * @imported:	where to store the number of texts pushed
+ *
+ * Pushes the whole records in @buf, one by one with ktext_push(),
+ * unpacking the coalesced ones. A truncated record at the end is
+ * not consumed. A record is consumed once all its texts are in:
+ * on errors, @used, @skip and @imported tell where to resume.
+ * Each text takes a FIFO slot with ktext_reserve() first.
+ * Returns 0, -EINVAL on a malformed record, -ENOSPC if the FIFO is
+ * full (KTEXT_FULL_REJECT), or the ktext_push() errors.
+ */
+int __must_check
+ktext_import(ktext_object_t *k, const char *buf, size_t len, size_t *used,
+		u32 *skip, unsigned int *imported);
+
+/**
+ * ktext_count_dropped() - account a text dropped before reaching
+ * 			   ktext_push()
+ *
+ * @k:		the ktext_object_t object
+ *
+ */
+void
+ktext_count_dropped(ktext_object_t *k);
 
 /**
  * ktext_empty() - empty the FIFO, releasing all the text objects in it.
@@ -133,23 +596,31 @@ ktext_writer_trylock(ktext_object_t *k);
 
 /**
  * ktext_reader_lock() - 	acquire a reader lock
- * 				(uninterruptible)
+ * 				(killable)
  *
- * @k: 	the ktext_object_t object
+ * @k: 		the ktext_object_t object
+ * @timeout:	acquisition deadline in jiffies, 0 for none
+ *
+ * Spin for a short while (see KTEXT_LOCK_SPIN), then sleep.
+ * Return 0 for success, -EINTR if killed, -ETIMEDOUT if
+ * @timeout expired.
  *
  */
 int __must_check
-ktext_reader_lock(ktext_object_t *k);
+ktext_reader_lock(ktext_object_t *k, unsigned long timeout);
 
 /**
  * ktext_writer_lock() - 	acquire a writer lock
- * 				(uninterruptible)
+ * 				(killable)
  *
- * @k: 	the ktext_object object
+ * @k: 		the ktext_object object
+ * @timeout:	acquisition deadline in jiffies, 0 for none
+ *
+ * Same as ktext_reader_lock().
  *
  */
 int __must_check
-ktext_writer_lock(ktext_object_t *k);
+ktext_writer_lock(ktext_object_t *k, unsigned long timeout);
 
 /**
  * ktext_reader_unlock() - release a reader lock
@@ -0,0 +1,258 @@
+/*
+ * ktext_quota.c
+ *
+ * ktext_quota functions used by ktext_mod.c and ktext_object.c.
+ *
+ * Copyright (C) 2011 Fabio Erculiani
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ * NON INFRINGEMENT.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <asm/atomic.h>
+
+#include "ktext_config.h"
+#include "ktext_quota.h"
+
+/**
+ * struct ktext_quota_table - hash table of the writers quotas
+ *
+ * @lock:	protects @buckets and the token buckets of the quotas
+ * @buckets:	the hash buckets, keyed by tgid
+ */
+struct ktext_quota_table {
+	spinlock_t lock;
+	struct hlist_head buckets[1 << KTEXT_QUOTA_HASH_BITS];
+};
+
+/**
+ * struct ktext_quota - the quota of a single process
+ *
+ * @hn:		the hash bucket hlist_node object
+ * @tgid:	the process
+ * @refs:	references held by open writers and queued texts
+ * @resident:	number of texts of @tgid in the FIFO
+ * @msgs:	texts token bucket, a text costs HZ
+ * @bytes:	bytes token bucket, a byte costs HZ
+ * @stamp:	last refill of the token buckets, in jiffies
+ */
+struct ktext_quota {
+	struct hlist_node hn;
+	pid_t tgid;
+	atomic_t refs;
+	atomic_t resident;
+	s64 msgs;
+	s64 bytes;
+	unsigned long stamp;
+};
+
+int __must_check
+ktext_quota_table_init(ktext_quota_table_t **t)
+{
+	int i;
+
+	*t = kmalloc(sizeof(ktext_quota_table_t), GFP_KERNEL);
+	if (*t == NULL)
+		return -ENOMEM;
+
+	spin_lock_init(&(*t)->lock);
+	for (i = 0; i < (1 << KTEXT_QUOTA_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&(*t)->buckets[i]);
+	return 0;
+}
+
+void
+ktext_quota_table_destroy(ktext_quota_table_t **t)
+{
+	struct hlist_node *tmp;
+	ktext_quota_t *q;
+	int i;
+
+	for (i = 0; i < (1 << KTEXT_QUOTA_HASH_BITS); i++) {
+		while (!hlist_empty(&(*t)->buckets[i])) {
+			tmp = (*t)->buckets[i].first;
+			q = hlist_entry(tmp, ktext_quota_t, hn);
+			WARN_ON(atomic_read(&q->refs) != 0);
+			hlist_del(&q->hn);
+			kfree(q);
+		}
+	}
+	kfree(*t);
+	*t = NULL;
+}
+
+/**
+ * ktext_quota_lookup() - find the quota of a process, reclaiming
+ * 			  the idle ones sharing its bucket.
+ *
+ * @t:		the ktext_quota_table_t object, t->lock held
+ * @tgid:	the process
+ *
+ * A quota is idle once nobody references it and its buckets had
+ * a second to fill up again: it would be created just like that.
+ *
+ */
+static ktext_quota_t *
+ktext_quota_lookup(ktext_quota_table_t *t, pid_t tgid)
+{
+	struct hlist_head *bucket;
+	struct hlist_node *pos, *tmp;
+	ktext_quota_t *q, *found;
+
+	found = NULL;
+	bucket = &t->buckets[hash_32((u32) tgid, KTEXT_QUOTA_HASH_BITS)];
+	for (pos = bucket->first; pos != NULL; pos = tmp) {
+		tmp = pos->next;
+		q = hlist_entry(pos, ktext_quota_t, hn);
+		if (q->tgid == tgid) {
+			found = q;
+			continue;
+		}
+		if (atomic_read(&q->refs) == 0 &&
+				time_after(jiffies, q->stamp + HZ)) {
+			hlist_del(&q->hn);
+			kfree(q);
+		}
+	}
+	return found;
+}
+
+ktext_quota_t *
+ktext_quota_get(ktext_quota_table_t *t, pid_t tgid)
+{
+	ktext_quota_t *q, *new_q;
+
+	spin_lock(&t->lock);
+	q = ktext_quota_lookup(t, tgid);
+	if (q != NULL)
+		goto ktext_quota_get_found;
+	spin_unlock(&t->lock);
+
+	new_q = kmalloc(sizeof(ktext_quota_t), GFP_KERNEL);
+	if (new_q == NULL)
+		return NULL;
+	new_q->tgid = tgid;
+	atomic_set(&new_q->refs, 0);
+	atomic_set(&new_q->resident, 0);
+	new_q->msgs = 0;
+	new_q->bytes = 0;
+	/* a second ago: the first refill fills up the buckets */
+	new_q->stamp = jiffies - HZ;
+
+	spin_lock(&t->lock);
+	/* somebody else might have been faster */
+	q = ktext_quota_lookup(t, tgid);
+	if (q == NULL) {
+		q = new_q;
+		new_q = NULL;
+		hlist_add_head(&q->hn,
+				&t->buckets[hash_32((u32) tgid, KTEXT_QUOTA_HASH_BITS)]);
+	}
+	kfree(new_q);
+
+ktext_quota_get_found:
+	atomic_inc(&q->refs);
+	spin_unlock(&t->lock);
+	return q;
+}
+
+void
+ktext_quota_put(ktext_quota_t *q)
+{
+	/* reclaimed lazily by ktext_quota_lookup() */
+	atomic_dec(&q->refs);
+}
+
+/**
+ * ktext_quota_refill() - refill the token buckets of a quota
+ *
+ * @q:			the ktext_quota_t object, table lock held
+ * @msgs_rate:		texts per second
+ * @bytes_rate:		bytes per second
+ *
+ */
+static void
+ktext_quota_refill(ktext_quota_t *q, unsigned int msgs_rate,
+		unsigned int bytes_rate)
+{
+	unsigned long elapsed;
+
+	elapsed = jiffies - q->stamp;
+	if (elapsed > HZ)
+		/* one second of burst at most */
+		elapsed = HZ;
+	q->stamp = jiffies;
+
+	q->msgs = min_t(s64, q->msgs + (s64) elapsed * msgs_rate,
+			(s64) msgs_rate * HZ);
+	q->bytes = min_t(s64, q->bytes + (s64) elapsed * bytes_rate,
+			(s64) bytes_rate * HZ);
+}
+
+int __must_check
+ktext_quota_admit(ktext_quota_table_t *t, ktext_quota_t *q,
+		unsigned int msgs_rate, unsigned int bytes_rate,
+		unsigned int max_resident)
+{
+	int admit;
+
+	admit = 1;
+
+	spin_lock(&t->lock);
+	ktext_quota_refill(q, msgs_rate, bytes_rate);
+	if (msgs_rate && q->msgs < HZ)
+		admit = 0;
+	if (bytes_rate && q->bytes <= 0)
+		admit = 0;
+	if (max_resident && atomic_read(&q->resident) >= max_resident)
+		admit = 0;
+	if (admit && msgs_rate)
+		q->msgs -= HZ;
+	spin_unlock(&t->lock);
+
+	return admit;
+}
+
+void
+ktext_quota_charge(ktext_quota_table_t *t, ktext_quota_t *q, size_t bytes,
+		unsigned int bytes_rate)
+{
+	if (!bytes_rate)
+		return;
+
+	spin_lock(&t->lock);
+	q->bytes -= (s64) bytes * HZ;
+	spin_unlock(&t->lock);
+}
+
+void
+ktext_quota_enqueued(ktext_quota_t *q)
+{
+	atomic_inc(&q->refs);
+	atomic_inc(&q->resident);
+}
+
+void
+ktext_quota_dequeued(ktext_quota_t *q)
+{
+	atomic_dec(&q->resident);
+	atomic_dec(&q->refs);
+}
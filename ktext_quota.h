@@ -0,0 +1,144 @@
+/*
+ * ktext_quota.h
+ *
+ * Per-process (tgid) writers quotas.
+ *
+ * Copyright (C) 2011 Fabio Erculiani
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ * NON INFRINGEMENT.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef KTEXT_QUOTA_H_
+#define KTEXT_QUOTA_H_
+
+#include <linux/types.h>
+
+/**
+ * enum ktext_quota_policy - what happens to writers over quota
+ *
+ * @KTEXT_QUOTA_REJECT:	open() fails with -EAGAIN
+ * @KTEXT_QUOTA_DROP:	open() succeeds, the text is silently dropped
+ */
+enum ktext_quota_policy {
+	KTEXT_QUOTA_REJECT = 0,
+	KTEXT_QUOTA_DROP = 1,
+};
+
+/**
+ * struct ktext_quota_table - hash table of the writers quotas,
+ * 			      keyed by tgid. Opaque object.
+ */
+typedef struct ktext_quota_table ktext_quota_table_t;
+
+/**
+ * struct ktext_quota - the quota of a single process. Opaque object.
+ */
+typedef struct ktext_quota ktext_quota_t;
+
+/**
+ * ktext_quota_table_init() - allocate a quota table
+ *
+ * @t:		where to store the ktext_quota_table_t object
+ *
+ */
+int __must_check
+ktext_quota_table_init(ktext_quota_table_t **t);
+
+/**
+ * ktext_quota_table_destroy() - free a quota table
+ *
+ * @t:		the ktext_quota_table_t object, with no reference
+ * 		left on its quotas
+ *
+ */
+void
+ktext_quota_table_destroy(ktext_quota_table_t **t);
+
+/**
+ * ktext_quota_get() - look up (or create) the quota of a process
+ *
+ * @t:		the ktext_quota_table_t object
+ * @tgid:	the process
+ *
+ * A reference is taken, give it back with ktext_quota_put().
+ * Idle quotas met on the way are reclaimed.
+ * Returns NULL if out of memory.
+ */
+ktext_quota_t *
+ktext_quota_get(ktext_quota_table_t *t, pid_t tgid);
+
+/**
+ * ktext_quota_put() - give back a reference taken by ktext_quota_get()
+ *
+ * @q:		the ktext_quota_t object
+ *
+ */
+void
+ktext_quota_put(ktext_quota_t *q);
+
+/**
+ * ktext_quota_admit() - shall a new text be accepted?
+ *
+ * @t:			the ktext_quota_table_t object
+ * @q:			the ktext_quota_t object
+ * @msgs_rate:		texts per second, 0 for unlimited
+ * @bytes_rate:		bytes per second, 0 for unlimited
+ * @max_resident:	maximum number of texts in the FIFO, 0 for
+ * 			unlimited
+ *
+ * Token buckets, with one second of burst. A text costs a message
+ * token right away, its bytes are charged by ktext_quota_charge()
+ * once known, so the bytes bucket can go in debt.
+ * Returns 1 if the text is accepted, 0 if over quota.
+ */
+int __must_check
+ktext_quota_admit(ktext_quota_table_t *t, ktext_quota_t *q,
+		unsigned int msgs_rate, unsigned int bytes_rate,
+		unsigned int max_resident);
+
+/**
+ * ktext_quota_charge() - charge the bytes of an accepted text
+ *
+ * @t:			the ktext_quota_table_t object
+ * @q:			the ktext_quota_t object
+ * @bytes:		the length of the text
+ * @bytes_rate:		bytes per second, 0 for unlimited
+ *
+ */
+void
+ktext_quota_charge(ktext_quota_table_t *t, ktext_quota_t *q, size_t bytes,
+		unsigned int bytes_rate);
+
+/**
+ * ktext_quota_enqueued() - a text of @q has been queued on the FIFO
+ *
+ * @q:		the ktext_quota_t object
+ *
+ * Takes a reference, dropped by ktext_quota_dequeued().
+ */
+void
+ktext_quota_enqueued(ktext_quota_t *q);
+
+/**
+ * ktext_quota_dequeued() - a text of @q has left the FIFO
+ *
+ * @q:		the ktext_quota_t object
+ *
+ */
+void
+ktext_quota_dequeued(ktext_quota_t *q);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * ktext_bench.c
+ *
+ * libktext vs raw syscalls, in operations per second
+ *
+ * Copyright (C) 2011 Fabio Erculiani
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ * NON INFRINGEMENT.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Usage: ktext_bench [-n texts] [-s size] [-t threads] [-d device]
+ *
+ * Pushes, then pops, n texts of the given size, first the naive
+ * way (one open() + write()/read() + close() per text, spinning
+ * on EAGAIN), then through libktext, with t threads (each one
+ * pushing and popping n / t texts). Load the module with
+ * max_elements=0 for the pushes not to hit the limit.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libktext.h"
+
+static const char *device = LIBKTEXT_DEVICE;
+static unsigned long n_texts = 100000;
+static size_t text_size = 64;
+static unsigned int n_threads = 1;
+static ktext_client_t *client;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *what, unsigned long ops, unsigned long failed, double secs)
+{
+	printf("%-12s %10lu ops %8lu failed %10.3fs %12.0f ops/s\n",
+			what, ops, failed, secs, ops / secs);
+}
+
+/* open() the naive way, spinning on the readers/writers lock */
+static int
+raw_open(int flags)
+{
+	int fd;
+
+	while ((fd = open(device, flags | O_NONBLOCK)) < 0 && errno == EAGAIN)
+		sched_yield();
+	return fd;
+}
+
+static void
+bench_raw(void)
+{
+	char *text;
+	char *buf;
+	unsigned long i;
+	unsigned long failed;
+	double start;
+	ssize_t n;
+	int fd;
+
+	text = malloc(text_size);
+	buf = malloc(text_size + 1);
+	if (text == NULL || buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(text, 'k', text_size);
+
+	failed = 0;
+	start = now();
+	for (i = 0; i < n_texts; i++) {
+		fd = raw_open(O_WRONLY);
+		if (fd < 0 || write(fd, text, text_size) != (ssize_t) text_size)
+			failed++;
+		if (fd >= 0)
+			close(fd);
+	}
+	report("raw push", n_texts, failed, now() - start);
+
+	failed = 0;
+	start = now();
+	for (i = 0; i < n_texts; i++) {
+		fd = raw_open(O_RDONLY);
+		n = fd < 0 ? -1 : read(fd, buf, text_size + 1);
+		if (n <= 0)
+			failed++;
+		if (fd >= 0)
+			close(fd);
+	}
+	report("raw pop", n_texts, failed, now() - start);
+
+	free(text);
+	free(buf);
+}
+
+struct lib_result {
+	unsigned long ops;
+	unsigned long failed;
+};
+
+static void *
+lib_push_thread(void *data)
+{
+	struct lib_result *res;
+	ktext_handle_t *h;
+	char *text;
+	unsigned long i;
+
+	res = (struct lib_result *) data;
+	h = ktext_handle(client);
+	text = malloc(text_size);
+	if (h == NULL || text == NULL) {
+		res->failed = n_texts / n_threads;
+		free(text);
+		return NULL;
+	}
+	memset(text, 'k', text_size);
+
+	for (i = 0; i < n_texts / n_threads; i++) {
+		if (ktext_push(h, text, text_size, 0) != 0)
+			res->failed++;
+		res->ops++;
+	}
+	if (ktext_flush(h) != 0)
+		res->failed++;
+	free(text);
+	return NULL;
+}
+
+static void *
+lib_pop_thread(void *data)
+{
+	struct lib_result *res;
+	ktext_handle_t *h;
+	const void *text;
+	size_t len;
+	unsigned long i;
+
+	res = (struct lib_result *) data;
+	h = ktext_handle(client);
+	if (h == NULL) {
+		res->failed = n_texts / n_threads;
+		return NULL;
+	}
+
+	for (i = 0; i < n_texts / n_threads; i++) {
+		if (ktext_pop(h, &text, &len) != 0)
+			res->failed++;
+		res->ops++;
+	}
+	return NULL;
+}
+
+static void
+bench_lib(const char *what, void *(*fn)(void *))
+{
+	pthread_t *threads;
+	struct lib_result *res;
+	unsigned long ops;
+	unsigned long failed;
+	unsigned int i;
+	double start;
+
+	threads = calloc(n_threads, sizeof(*threads));
+	res = calloc(n_threads, sizeof(*res));
+	if (threads == NULL || res == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	start = now();
+	for (i = 0; i < n_threads; i++)
+		pthread_create(&threads[i], NULL, fn, &res[i]);
+	ops = failed = 0;
+	for (i = 0; i < n_threads; i++) {
+		pthread_join(threads[i], NULL);
+		ops += res[i].ops;
+		failed += res[i].failed;
+	}
+	report(what, ops, failed, now() - start);
+
+	free(threads);
+	free(res);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ktext_client_conf conf;
+	int status;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:t:d:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n_texts = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			text_size = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			n_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n texts] [-s size] "
+					"[-t threads] [-d device]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n_threads == 0)
+		n_threads = 1;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.path = device;
+	status = ktext_client_init(&client, &conf);
+	if (status != 0) {
+		fprintf(stderr, "ktext_client_init: %s\n", strerror(-status));
+		return 1;
+	}
+
+	bench_raw();
+	bench_lib("libktext push", lib_push_thread);
+	bench_lib("libktext pop", lib_pop_thread);
+
+	ktext_client_destroy(client);
+	return 0;
+}
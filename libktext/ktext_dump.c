@@ -0,0 +1,88 @@
+/*
+ * ktext_dump.c
+ *
+ * save and restore the /dev/ktext FIFO content, across module reloads
+ *
+ * Copyright (C) 2011 Fabio Erculiani
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ * NON INFRINGEMENT.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Usage: ktext_dump export|import <file> [ctl device]
+ *
+ * <file> being "-" for stdout (export) or stdin (import). E.g.:
+ *
+ *	ktext_dump export /var/tmp/ktext.dump && rmmod ktext
+ *	insmod ktext.ko ... && ktext_dump import /var/tmp/ktext.dump
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libktext.h"
+
+int
+main(int argc, char **argv)
+{
+	const char *ctl;
+	long long n;
+	bool export;
+	int fd;
+
+	if (argc < 3 || argc > 4 || (strcmp(argv[1], "export") &&
+				strcmp(argv[1], "import"))) {
+		fprintf(stderr, "usage: %s export|import <file> [ctl device]\n",
+				argv[0]);
+		return 1;
+	}
+	export = !strcmp(argv[1], "export");
+	ctl = argc == 4 ? argv[3] : NULL;
+
+	if (!strcmp(argv[2], "-"))
+		fd = export ? STDOUT_FILENO : STDIN_FILENO;
+	else if (export)
+		fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	else
+		fd = open(argv[2], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	if (export)
+		n = ktext_export_fd(ctl, fd);
+	else
+		n = ktext_import_fd(ctl, fd);
+	if (n < 0) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(-n));
+		return 1;
+	}
+	if (export && fd != STDOUT_FILENO && fsync(fd) < 0) {
+		perror("fsync");
+		return 1;
+	}
+	if (close(fd) < 0) {
+		perror("close");
+		return 1;
+	}
+
+	fprintf(stderr, "%sed %lld texts\n", argv[1], n);
+	return 0;
+}
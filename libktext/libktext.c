@@ -0,0 +1,651 @@
+/*
+ * libktext.c
+ *
+ * libktext, a /dev/ktext client library
+ *
+ * Copyright (C) 2011 Fabio Erculiani
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ * NON INFRINGEMENT.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libktext.h"
+#include "../ktext_ioctl.h"
+
+#define LIBKTEXT_POP_SIZE (64 * 1024)
+#define LIBKTEXT_RETRIES 10
+#define LIBKTEXT_BACKOFF_US 100
+#define LIBKTEXT_BACKOFF_MAX_US 100000
+/* the dump buffer, as few syscalls as possible */
+#define LIBKTEXT_DUMP_SIZE (1024 * 1024)
+
+/**
+ * struct ktext_handle - per thread state
+ *
+ * @c:		the client owning the handle
+ * @next:	the next handle, on the client live or free list
+ * @batch:	the texts waiting to be pushed, each one preceded by
+ * 		its length
+ * @batch_len:	the length of @batch
+ * @batch_n:	the number of texts in @batch
+ * @batch_prio:	their priority level
+ * @pop:	the texts read and not popped yet, as framed by
+ * 		KTEXT_FRAMING_LENGTH
+ * @pop_len:	the length of @pop
+ * @pop_off:	the offset of the next text (or record) in @pop
+ * @rec_off:	the offset of the next text in the current record,
+ * 		coalesced records only
+ * @rec_end:	the end of the current record, 0 if none
+ */
+struct ktext_handle {
+	ktext_client_t *c;
+	struct ktext_handle *next;
+	char *batch;
+	size_t batch_len;
+	unsigned int batch_n;
+	unsigned int batch_prio;
+	char *pop;
+	size_t pop_len;
+	size_t pop_off;
+	size_t rec_off;
+	size_t rec_end;
+};
+
+/**
+ * struct ktext_client - a client, shared by the threads of a process
+ *
+ * @conf:	the tunables, defaults filled in
+ * @text_size:	KTEXT_SIZE
+ * @records:	the module packs texts in coalesced records
+ * @key:	the thread specific key of the handles
+ * @lock:	protects @live and @free
+ * @live:	the handles in use
+ * @free:	the handles of exited threads, ready for reuse
+ */
+struct ktext_client {
+	struct ktext_client_conf conf;
+	size_t text_size;
+	bool records;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	ktext_handle_t *live;
+	ktext_handle_t *free;
+};
+
+static void
+ktext_handle_unlink(ktext_handle_t **list, ktext_handle_t *h)
+{
+	ktext_handle_t **p;
+
+	for (p = list; *p != NULL; p = &(*p)->next) {
+		if (*p == h) {
+			*p = h->next;
+			break;
+		}
+	}
+	h->next = NULL;
+}
+
+static void
+ktext_handle_free(ktext_handle_t *h)
+{
+	free(h->batch);
+	free(h->pop);
+	free(h);
+}
+
+/* pthread_key_create() destructor, at thread exit */
+static void
+ktext_handle_release(void *data)
+{
+	ktext_handle_t *h;
+	ktext_client_t *c;
+
+	h = (ktext_handle_t *) data;
+	c = h->c;
+	ktext_flush(h);
+	/* whatever was read and not popped is lost, as documented */
+	h->pop_len = h->pop_off = 0;
+	h->rec_off = h->rec_end = 0;
+
+	pthread_mutex_lock(&c->lock);
+	ktext_handle_unlink(&c->live, h);
+	h->next = c->free;
+	c->free = h;
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* does the module pack texts in records? */
+static bool
+ktext_records_enabled(void)
+{
+	FILE *f;
+	unsigned int size;
+	bool enabled;
+
+	f = fopen(LIBKTEXT_PARAMS "/coalesce_size", "r");
+	if (f == NULL)
+		/* not loaded, or too old to coalesce */
+		return false;
+	enabled = fscanf(f, "%u", &size) == 1 && size != 0;
+	fclose(f);
+	return enabled;
+}
+
+int
+ktext_client_init(ktext_client_t **c, const struct ktext_client_conf *conf)
+{
+	ktext_client_t *cl;
+	long page_size;
+	int status;
+
+	cl = calloc(1, sizeof(*cl));
+	if (cl == NULL)
+		return -ENOMEM;
+	if (conf)
+		cl->conf = *conf;
+
+	/* KTEXT_SIZE, see ktext_config.h */
+	page_size = sysconf(_SC_PAGESIZE);
+	cl->text_size = page_size - 1 - 100;
+
+	if (cl->conf.path == NULL)
+		cl->conf.path = LIBKTEXT_DEVICE;
+	if (cl->conf.batch_size == 0 || cl->conf.batch_size > cl->text_size)
+		cl->conf.batch_size = cl->text_size;
+	if (cl->conf.pop_size == 0)
+		cl->conf.pop_size = LIBKTEXT_POP_SIZE;
+	/* a record, with its length */
+	if (cl->conf.pop_size < cl->text_size + 2 * sizeof(__u32))
+		cl->conf.pop_size = cl->text_size + 2 * sizeof(__u32);
+	if (cl->conf.retries == 0)
+		cl->conf.retries = LIBKTEXT_RETRIES;
+	if (cl->conf.backoff_us == 0)
+		cl->conf.backoff_us = LIBKTEXT_BACKOFF_US;
+	if (cl->conf.backoff_max_us == 0)
+		cl->conf.backoff_max_us = LIBKTEXT_BACKOFF_MAX_US;
+	if (cl->conf.records == 0)
+		cl->records = ktext_records_enabled();
+	else
+		cl->records = cl->conf.records > 0;
+
+	status = pthread_key_create(&cl->key, ktext_handle_release);
+	if (status != 0) {
+		free(cl);
+		return -status;
+	}
+	pthread_mutex_init(&cl->lock, NULL);
+
+	*c = cl;
+	return 0;
+}
+
+void
+ktext_client_destroy(ktext_client_t *c)
+{
+	ktext_handle_t *h;
+
+	/* no more destructor calls from now on */
+	pthread_key_delete(c->key);
+
+	while ((h = c->live) != NULL) {
+		c->live = h->next;
+		ktext_flush(h);
+		ktext_handle_free(h);
+	}
+	while ((h = c->free) != NULL) {
+		c->free = h->next;
+		ktext_handle_free(h);
+	}
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+ktext_handle_t *
+ktext_handle(ktext_client_t *c)
+{
+	ktext_handle_t *h;
+
+	h = pthread_getspecific(c->key);
+	if (h != NULL)
+		return h;
+
+	pthread_mutex_lock(&c->lock);
+	h = c->free;
+	if (h != NULL)
+		c->free = h->next;
+	pthread_mutex_unlock(&c->lock);
+
+	if (h == NULL) {
+		h = calloc(1, sizeof(*h));
+		if (h == NULL)
+			return NULL;
+		h->c = c;
+		h->batch = malloc(c->conf.batch_size);
+		h->pop = malloc(c->conf.pop_size);
+		if (h->batch == NULL || h->pop == NULL) {
+			ktext_handle_free(h);
+			return NULL;
+		}
+	}
+
+	if (pthread_setspecific(c->key, h) != 0) {
+		pthread_mutex_lock(&c->lock);
+		h->next = c->free;
+		c->free = h;
+		pthread_mutex_unlock(&c->lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	h->next = c->live;
+	c->live = h;
+	pthread_mutex_unlock(&c->lock);
+	return h;
+}
+
+/**
+ * ktext_open_retry() - open() the device, backing off on EAGAIN
+ * 			and ENOSPC
+ *
+ * @c:		the ktext_client_t object
+ * @flags:	the open() flags
+ *
+ * O_NONBLOCK is always added: waiting for the readers/writers
+ * lock here, rather than in the kernel, lets the other threads
+ * of the process go on meanwhile.
+ * Returns the file descriptor, or -errno.
+ */
+static int
+ktext_open_retry(ktext_client_t *c, int flags)
+{
+	unsigned int backoff;
+	unsigned int tries;
+	int fd;
+
+	backoff = c->conf.backoff_us;
+	for (tries = 0; ; tries++) {
+		fd = open(c->conf.path, flags | O_NONBLOCK);
+		if (fd >= 0)
+			return fd;
+		if ((errno != EAGAIN && errno != ENOSPC) ||
+				tries == c->conf.retries)
+			return -errno;
+		usleep(backoff);
+		backoff *= 2;
+		if (backoff > c->conf.backoff_max_us)
+			backoff = c->conf.backoff_max_us;
+	}
+}
+
+/* write() it all, unless an error happens */
+static int
+ktext_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * ktext_push_one() - push a text, or a batch of framed texts
+ *
+ * @h:		the ktext_handle_t object
+ * @buf:	what to write
+ * @len:	the length of @buf
+ * @prio:	the priority level
+ * @framed:	@buf is framed, see KTEXT_IOC_SET_FRAMING
+ *
+ */
+static int
+ktext_push_one(ktext_handle_t *h, const char *buf, size_t len,
+		unsigned int prio, bool framed)
+{
+	__u32 val;
+	int status;
+	int fd;
+
+	fd = ktext_open_retry(h->c, O_WRONLY);
+	if (fd < 0)
+		return fd;
+
+	status = 0;
+	if (prio != 0) {
+		val = prio;
+		if (ioctl(fd, KTEXT_IOC_SET_PRIO, &val) < 0) {
+			status = -errno;
+			goto ktext_push_one_quit;
+		}
+	}
+	if (framed) {
+		val = KTEXT_FRAMING_LENGTH;
+		if (ioctl(fd, KTEXT_IOC_SET_FRAMING, &val) < 0) {
+			status = -errno;
+			goto ktext_push_one_quit;
+		}
+	}
+	status = ktext_write_all(fd, buf, len);
+
+ktext_push_one_quit:
+	/* the text is pushed by close(), or dropped on errors */
+	if (close(fd) < 0 && status == 0)
+		status = -errno;
+	return status;
+}
+
+int
+ktext_flush(ktext_handle_t *h)
+{
+	int status;
+
+	if (h->batch_n == 0)
+		return 0;
+	if (h->batch_n == 1)
+		/* no need for framing, modules without writers
+		 * framing keep working */
+		status = ktext_push_one(h, h->batch + sizeof(__u32),
+				h->batch_len - sizeof(__u32), h->batch_prio,
+				false);
+	else
+		status = ktext_push_one(h, h->batch, h->batch_len,
+				h->batch_prio, true);
+
+	h->batch_len = 0;
+	h->batch_n = 0;
+	return status;
+}
+
+int
+ktext_push(ktext_handle_t *h, const void *data, size_t len, unsigned int prio)
+{
+	__u32 len32;
+	int status;
+
+	if (len > h->c->text_size)
+		return -EMSGSIZE;
+
+	status = 0;
+	if (h->batch_n && (prio != h->batch_prio ||
+			h->batch_len + sizeof(len32) + len > h->c->conf.batch_size))
+		status = ktext_flush(h);
+	if (status < 0)
+		/* the caller shall know that this text went nowhere */
+		return status;
+
+	if (sizeof(len32) + len > h->c->conf.batch_size)
+		/* a batch of its own would not fit */
+		return ktext_push_one(h, data, len, prio, false);
+
+	len32 = len;
+	memcpy(h->batch + h->batch_len, &len32, sizeof(len32));
+	memcpy(h->batch + h->batch_len + sizeof(len32), data, len);
+	h->batch_len += sizeof(len32) + len;
+	h->batch_n++;
+	h->batch_prio = prio;
+	return status;
+}
+
+/**
+ * ktext_refill() - read as many texts as they fit in the pop buffer
+ *
+ * @h:		the ktext_handle_t object
+ *
+ */
+static int
+ktext_refill(ktext_handle_t *h)
+{
+	__u32 val;
+	ssize_t n;
+	int status;
+	int fd;
+
+	fd = ktext_open_retry(h->c, O_RDONLY);
+	if (fd < 0)
+		return fd;
+
+	status = 0;
+	val = KTEXT_FRAMING_LENGTH;
+	if (ioctl(fd, KTEXT_IOC_SET_FRAMING, &val) < 0) {
+		status = -errno;
+		goto ktext_refill_quit;
+	}
+	do {
+		n = read(fd, h->pop, h->c->conf.pop_size);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		status = -errno;
+	else if (n == 0)
+		status = -ENODATA;
+	else {
+		h->pop_len = n;
+		h->pop_off = 0;
+	}
+
+ktext_refill_quit:
+	close(fd);
+	return status;
+}
+
+/* the next framed item in [*off, end), NULL if none */
+static const char *
+ktext_next_framed(const char *buf, size_t *off, size_t end, size_t *len)
+{
+	const char *item;
+	__u32 len32;
+
+	if (end - *off < sizeof(len32))
+		return NULL;
+	memcpy(&len32, buf + *off, sizeof(len32));
+	if (len32 > end - *off - sizeof(len32))
+		/* truncated, can't happen */
+		return NULL;
+	item = buf + *off + sizeof(len32);
+	*off += sizeof(len32) + len32;
+	*len = len32;
+	return item;
+}
+
+int
+ktext_pop(ktext_handle_t *h, const void **data, size_t *len)
+{
+	const char *item;
+	size_t item_len;
+	int status;
+
+	for (;;) {
+		if (h->rec_end) {
+			item = ktext_next_framed(h->pop, &h->rec_off,
+					h->rec_end, len);
+			if (item != NULL) {
+				*data = item;
+				return 0;
+			}
+			/* record done */
+			h->rec_end = 0;
+		}
+
+		item = ktext_next_framed(h->pop, &h->pop_off, h->pop_len,
+				&item_len);
+		if (item == NULL) {
+			status = ktext_refill(h);
+			if (status != 0)
+				return status;
+			continue;
+		}
+		if (!h->c->records) {
+			*data = item;
+			*len = item_len;
+			return 0;
+		}
+		h->rec_off = item - h->pop;
+		h->rec_end = h->rec_off + item_len;
+	}
+}
+
+/* read() it all, unless EOF or an error happens */
+static ssize_t
+ktext_read_all(int fd, char *buf, size_t len)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += n) {
+		n = read(fd, buf + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return -errno;
+		}
+		if (n == 0)
+			break;
+	}
+	return done;
+}
+
+long long
+ktext_export_fd(const char *ctl_path, int fd)
+{
+	struct ktext_dump_header hdr;
+	struct ktext_dump d;
+	long long exported;
+	char *buf;
+	int status;
+	int ctl;
+
+	buf = malloc(LIBKTEXT_DUMP_SIZE);
+	if (buf == NULL)
+		return -ENOMEM;
+	ctl = open(ctl_path ? ctl_path : LIBKTEXT_CTL_DEVICE, O_RDONLY);
+	if (ctl < 0) {
+		status = -errno;
+		free(buf);
+		return status;
+	}
+
+	hdr.magic = KTEXT_DUMP_MAGIC;
+	hdr.version = KTEXT_DUMP_VERSION;
+	status = ktext_write_all(fd, (const char *) &hdr, sizeof(hdr));
+	memset(&d, 0, sizeof(d));
+	exported = 0;
+	while (status == 0) {
+		d.addr = (unsigned long) buf;
+		d.len = LIBKTEXT_DUMP_SIZE;
+		if (ioctl(ctl, KTEXT_IOC_EXPORT, &d) < 0) {
+			status = -errno;
+			break;
+		}
+		if (d.len == 0)
+			/* drained */
+			break;
+		status = ktext_write_all(fd, buf, d.len);
+		exported += d.n_texts;
+	}
+
+	close(ctl);
+	free(buf);
+	if (status != 0)
+		return status;
+	return exported;
+}
+
+long long
+ktext_import_fd(const char *ctl_path, int fd)
+{
+	struct ktext_dump_header hdr;
+	struct ktext_dump d;
+	long long imported;
+	size_t len;
+	ssize_t n;
+	char *buf;
+	int status;
+	int ctl;
+
+	n = ktext_read_all(fd, (char *) &hdr, sizeof(hdr));
+	if (n < 0)
+		return n;
+	if (n != sizeof(hdr) || hdr.magic != KTEXT_DUMP_MAGIC ||
+			hdr.version != KTEXT_DUMP_VERSION)
+		return -EINVAL;
+
+	buf = malloc(LIBKTEXT_DUMP_SIZE);
+	if (buf == NULL)
+		return -ENOMEM;
+	ctl = open(ctl_path ? ctl_path : LIBKTEXT_CTL_DEVICE, O_RDONLY);
+	if (ctl < 0) {
+		status = -errno;
+		free(buf);
+		return status;
+	}
+
+	status = 0;
+	imported = 0;
+	len = 0;
+	/* d.skip is carried over from one call to the next */
+	memset(&d, 0, sizeof(d));
+	for (;;) {
+		n = ktext_read_all(fd, buf + len, LIBKTEXT_DUMP_SIZE - len);
+		if (n < 0) {
+			status = n;
+			break;
+		}
+		len += n;
+		if (len == 0)
+			break;
+
+		d.addr = (unsigned long) buf;
+		d.len = len;
+		if (ioctl(ctl, KTEXT_IOC_IMPORT, &d) < 0) {
+			status = -errno;
+			break;
+		}
+		imported += d.n_texts;
+		if (n == 0 && d.len < len) {
+			/* EOF in the middle of a record */
+			status = -EINVAL;
+			break;
+		}
+		/* keep the truncated record, if any */
+		len -= d.len;
+		memmove(buf, buf + d.len, len);
+	}
+
+	close(ctl);
+	free(buf);
+	if (status != 0)
+		return status;
+	return imported;
+}
@@ -0,0 +1,183 @@
+/*
+ * libktext.h
+ *
+ * libktext, a /dev/ktext client library
+ *
+ * Copyright (C) 2011 Fabio Erculiani
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE, GOOD TITLE or
+ * NON INFRINGEMENT.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef LIBKTEXT_H_
+#define LIBKTEXT_H_
+
+#include <stddef.h>
+
+#define LIBKTEXT_DEVICE "/dev/ktext"
+#define LIBKTEXT_CTL_DEVICE "/dev/ktext_ctl"
+/* where the module parameters are exposed */
+#define LIBKTEXT_PARAMS "/sys/module/ktext/parameters"
+
+/**
+ * struct ktext_client_conf - libktext tunables, 0 meaning default
+ *
+ * @path:		the device, LIBKTEXT_DEVICE if NULL
+ * @batch_size:		maximum length of a push batch, framing
+ * 			included, at most (and by default) KTEXT_SIZE
+ * @pop_size:		size of the pop buffer, default 64KiB, at least
+ * 			large enough for a single record
+ * @retries:		how many times open() is retried when it fails
+ * 			with EAGAIN or ENOSPC, default 10
+ * @backoff_us:		sleep before the first retry, doubled on each
+ * 			one, default 100us
+ * @backoff_max_us:	the longest sleep between retries, default 100ms
+ * @records:		1: texts come packed in coalesced records (see
+ * 			coalesce_size=), -1: they don't, 0: ask the module
+ */
+struct ktext_client_conf {
+	const char *path;
+	size_t batch_size;
+	size_t pop_size;
+	unsigned int retries;
+	unsigned int backoff_us;
+	unsigned int backoff_max_us;
+	int records;
+};
+
+typedef struct ktext_client ktext_client_t;
+typedef struct ktext_handle ktext_handle_t;
+
+/**
+ * ktext_client_init() - create a client
+ *
+ * @c:		where to store the new ktext_client_t object
+ * @conf:	the tunables, NULL for the defaults
+ *
+ * A client is shared by all the threads of a process, each
+ * one pushing and popping through its own handle, see
+ * ktext_handle().
+ * With conf->records == 0, coalesce_size is read from
+ * LIBKTEXT_PARAMS to tell whether the module packs texts in
+ * records.
+ * Returns 0 on success, -errno on failure.
+ */
+int
+ktext_client_init(ktext_client_t **c, const struct ktext_client_conf *conf);
+
+/**
+ * ktext_client_destroy() - destroy a client
+ *
+ * @c:		the ktext_client_t object
+ *
+ * Flush the pending pushes of every handle and free them all:
+ * handles are no longer usable afterwards, by any thread.
+ * Texts popped but not yet returned by ktext_pop() are lost.
+ */
+void
+ktext_client_destroy(ktext_client_t *c);
+
+/**
+ * ktext_handle() - get the handle of the calling thread
+ *
+ * @c:		the ktext_client_t object
+ *
+ * The handle is created on first use and handed back to the
+ * client, pending pushes flushed, when the thread exits. Its
+ * buffers are then reused by the next thread asking for one.
+ * A handle shall only be used by the thread it belongs to.
+ * Returns NULL if out of memory.
+ */
+ktext_handle_t *
+ktext_handle(ktext_client_t *c);
+
+/**
+ * ktext_push() - queue a text for pushing
+ *
+ * @h:		the ktext_handle_t object
+ * @data:	the text, may contain NUL bytes
+ * @len:	the length of @data, at most KTEXT_SIZE
+ * @prio:	the priority level, 0 being the most urgent
+ *
+ * The text is appended to the handle batch, which is pushed
+ * with a single open() + write() + close() once full, when
+ * a text with another priority level comes, or on
+ * ktext_flush(). A text too long to share a batch is pushed
+ * alone, right away. Returns 0 on success or -errno: if the
+ * batch that had to be flushed failed, its error is returned and
+ * the text is not queued, the caller may push it again.
+ */
+int
+ktext_push(ktext_handle_t *h, const void *data, size_t len, unsigned int prio);
+
+/**
+ * ktext_flush() - push the handle batch now
+ *
+ * @h:		the ktext_handle_t object
+ *
+ * open() is retried, with exponential backoff, as long as it
+ * fails with EAGAIN or ENOSPC, up to conf->retries times.
+ * The batch is emptied anyway. Returns 0 on success or -errno.
+ */
+int
+ktext_flush(ktext_handle_t *h);
+
+/**
+ * ktext_pop() - pop a text
+ *
+ * @h:		the ktext_handle_t object
+ * @data:	where to store a pointer to the text
+ * @len:	where to store its length
+ *
+ * Texts are read, in the handle pop buffer, as many at once as
+ * they fit, then handed out one by one. *@data points into the
+ * buffer, it is valid until the next ktext_pop() on @h.
+ * Texts in the buffer have left the FIFO already: they are lost
+ * if the process exits before popping them.
+ * Returns 0 on success, -ENODATA if the FIFO is empty, or
+ * -errno, see ktext_flush() for the retries.
+ */
+int
+ktext_pop(ktext_handle_t *h, const void **data, size_t *len);
+
+/**
+ * ktext_export_fd() - move the FIFO content to a dump file
+ *
+ * @ctl_path:	the control device, LIBKTEXT_CTL_DEVICE if NULL
+ * @fd:		where to write the dump
+ *
+ * Writes a struct ktext_dump_header, then the records of
+ * KTEXT_IOC_EXPORT, until the FIFO is empty. The texts leave the
+ * FIFO as they are exported: on a write error, those in the
+ * current buffer are lost.
+ * Returns the number of texts exported, or -errno.
+ */
+long long
+ktext_export_fd(const char *ctl_path, int fd);
+
+/**
+ * ktext_import_fd() - push the texts of a dump file
+ *
+ * @ctl_path:	the control device, LIBKTEXT_CTL_DEVICE if NULL
+ * @fd:		the dump, as written by ktext_export_fd()
+ *
+ * Returns the number of texts imported, -EINVAL if the dump is
+ * not valid or truncated, or -errno. On errors, the texts before
+ * the failing one have been imported, none of them twice.
+ */
+long long
+ktext_import_fd(const char *ctl_path, int fd);
+
+#endif